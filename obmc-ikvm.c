@@ -19,15 +19,23 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <linux/sockios.h>
 #include <linux/videodev2.h>
+#include <netdb.h>
 #include <pthread.h>
+#include <poll.h>
 #include <rfb/keysym.h>
 #include <rfb/rfb.h>
+#include <rfb/default8x16.h>
 #include <rfb/rfbproto.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -35,12 +43,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef _TLS_
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif /* _TLS_ */
+
+/* Exported by libvncserver but left out of its headers */
+extern rfbClientIteratorPtr
+rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
 //#define _DEBUG_
 //#define _PROFILE_
 
@@ -91,15 +113,112 @@ struct profile _wait;
 #endif /* _PROFILE_ */
 
 #define DUMP_FRAME_DIR		"/tmp/obmc-ikvm_frames"
+#define TRACE_FILE		"/tmp/obmc-ikvm_trace.json"
 
 #define BITS_PER_SAMPLE		5
 #define BYTES_PER_PIXEL		2
 #define SAMPLES_PER_PIXEL	1
 #define PTR_SIZE		5
+#define PTR_MAX			0x7FFF
+#define PTR_BUTTONS		0x07
+#define PTR_WHEEL_UP		0x08
+#define PTR_WHEEL_DOWN		0x10
+#define PTR_INTERVAL_US		1000
 #define REPORT_SIZE		8
 
 #define PROCESS_EVENTS_DELTA	100
 
+#define HID_UNIX_PREFIX		"unix:"
+#define PLAYBACK_PREFIX		"replay:"
+#define DEFAULT_WIDTH		1024
+#define DEFAULT_HEIGHT		768
+#define VIDEO_RETRY_MIN_MS	100
+#define VIDEO_RETRY_MAX_MS	5000
+#define VIDEO_TIMEOUT_MS	1000
+#define NO_SIGNAL_TEXT		"No signal"
+#define PACING_LATE_DIV		10
+
+#define LATENCY_IDLE		0
+#define LATENCY_WAITING		1
+#define LATENCY_SENDING		2
+#define LATENCY_INTERVAL_MS	500
+#define LATENCY_TIMEOUT_MS	2000
+
+#define SOAK_SOCKET		"/tmp/obmc-ikvm_soak.sock"
+#define SOAK_MIN_CYCLES		20
+#define SOAK_MODE_CYCLES	25
+#define SOAK_PRINT_CYCLES	100
+#define SOAK_INPUT_EVENTS	32
+#define SOAK_DRAIN_MS		20
+#define SOAK_TIMEOUT_S		5
+#define SOAK_RSS_SLACK_KB	512
+#define SOAK_DRIFT_SLACK_NS	5000000ULL
+
+#define RELAY_DEFAULT_PORT	"5500"
+#define RELAY_RETRY_MIN_MS	1000
+#define RELAY_RETRY_MAX_MS	30000
+#define RELAY_DNS_IDLE		0
+#define RELAY_DNS_BUSY		1
+#define RELAY_DNS_DONE		2
+
+#define EXPORT_MAGIC		0x4d564b49	/* "IKVM" */
+#define EXPORT_VERSION		1
+#define EXPORT_SLOTS		4
+#define EXPORT_MAX_CONSUMERS	8
+#define EXPORT_FULL		0x1
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+#define EVENTS_MAX_SUBSCRIBERS	8
+#define EVENTS_STABLE_MS	500
+
+#define MACRO_MAX_CONTROLLERS	4
+#define MACRO_MAX_KEYS		32
+#define MACRO_MAX_CHORD		4
+#define MACRO_HOLD_MS		20
+#define MACRO_GAP_MS		20
+#define MACRO_POLL_MS		10
+#define MACRO_IDLE		0
+#define MACRO_WAITING		1
+#define MACRO_RUNNING		2
+
+#define HEXTILE_SIZE		16
+#define THUMB_SCALE		4
+#define THUMB_INTERVAL_MS	1000
+#define RECT_TABLE_MIN		1024
+#define RECT_TABLE_MAX		65536
+#define RECT_CACHE_FRAMES	2
+#define ROI_REST_MS		2000
+
+/* RFB community extensions for flow control */
+#define RFB_CONTINUOUS_UPDATES	150
+#define RFB_FENCE		248
+#define RFB_ENCODING_FENCE	-312
+#define RFB_ENCODING_CU		-313
+#define RFB_FENCE_BLOCK_BEFORE	0x00000001
+#define RFB_FENCE_BLOCK_AFTER	0x00000002
+#define RFB_FENCE_SYNC_NEXT	0x00000004
+#define RFB_FENCE_REQUEST	0x80000000
+#define RFB_FENCE_SUPPORTED	(RFB_FENCE_BLOCK_BEFORE | \
+				 RFB_FENCE_BLOCK_AFTER | RFB_FENCE_SYNC_NEXT)
+#define RFB_FENCE_MAX_PAYLOAD	64
+
+#define RFB_SEC_VENCRYPT	19
+#define VENCRYPT_X509_NONE	262
+#define TLS_HANDSHAKE_MS	10000
+#define TLS_CIPHERS		"ECDHE-ECDSA-AES128-GCM-SHA256:" \
+				"ECDHE-RSA-AES128-GCM-SHA256:" \
+				"ECDHE-ECDSA-AES256-GCM-SHA384:" \
+				"ECDHE-RSA-AES256-GCM-SHA384"
+
+#define DEFAULT_MAX_LATENCY_MS	200
+#define FLOW_WINDOW_MIN		(64 * 1024)
+#define FLOW_WINDOW_MAX		(16 * 1024 * 1024)
+
+#define CLIENT_STALL_MS		10000
+
 #define FRAME_SIZE_BYTE_LIMIT	127
 #define FRAME_SIZE_WORD_LIMIT	16383
 
@@ -183,873 +302,6321 @@ struct profile _wait;
 #define USBHID_KEY_DOWN		0x51
 #define USBHID_KEY_UP		0x52
 #define USBHID_KEY_NUMLOCK	0x53
+#define USBHID_KEY_KPSLASH	0x54
+#define USBHID_KEY_KPASTERISK	0x55
+#define USBHID_KEY_KPMINUS	0x56
+#define USBHID_KEY_KPPLUS	0x57
+#define USBHID_KEY_KPENTER	0x58
+#define USBHID_KEY_KP1		0x59
+#define USBHID_KEY_KP2		0x5a
+#define USBHID_KEY_KP3		0x5b
+#define USBHID_KEY_KP4		0x5c
+#define USBHID_KEY_KP5		0x5d
+#define USBHID_KEY_KP6		0x5e
+#define USBHID_KEY_KP7		0x5f
+#define USBHID_KEY_KP8		0x60
+#define USBHID_KEY_KP9		0x61
+#define USBHID_KEY_KP0		0x62
+#define USBHID_KEY_KPDOT	0x63
+#define USBHID_KEY_102ND	0x64
+#define USBHID_KEY_COMPOSE	0x65
+#define USBHID_KEY_POWER	0x66
+#define USBHID_KEY_KPEQUAL	0x67
+#define USBHID_KEY_F13		0x68
+#define USBHID_KEY_F14		0x69
+#define USBHID_KEY_F15		0x6a
+#define USBHID_KEY_F16		0x6b
+#define USBHID_KEY_F17		0x6c
+#define USBHID_KEY_F18		0x6d
+#define USBHID_KEY_F19		0x6e
+#define USBHID_KEY_F20		0x6f
+#define USBHID_KEY_F21		0x70
+#define USBHID_KEY_F22		0x71
+#define USBHID_KEY_F23		0x72
+#define USBHID_KEY_F24		0x73
+#define USBHID_KEY_HELP		0x75
+#define USBHID_KEY_MUTE		0x7f
+#define USBHID_KEY_VOLUMEUP	0x80
+#define USBHID_KEY_VOLUMEDOWN	0x81
+#define USBHID_KEY_KPCOMMA	0x85
+#define USBHID_KEY_RO		0x87
+#define USBHID_KEY_KATAKANAHIRAGANA 0x88
+#define USBHID_KEY_YEN		0x89
+#define USBHID_KEY_HENKAN	0x8a
+#define USBHID_KEY_MUHENKAN	0x8b
+#define USBHID_KEY_HANGEUL	0x90
+#define USBHID_KEY_HANJA	0x91
+#define USBHID_KEY_SYSRQ	0x9a
+#define USBHID_KEY_LEFTCTRL	0xe0
+#define USBHID_KEY_LEFTSHIFT	0xe1
+#define USBHID_KEY_LEFTALT	0xe2
+#define USBHID_KEY_LEFTMETA	0xe3
+#define USBHID_KEY_RIGHTCTRL	0xe4
+#define USBHID_KEY_RIGHTSHIFT	0xe5
+#define USBHID_KEY_RIGHTALT	0xe6
+#define USBHID_KEY_RIGHTMETA	0xe7
+
+#define USBHID_MOD_LEFTSHIFT	0x02
+#define USBHID_MOD_RIGHTSHIFT	0x20
+
+/* Keysyms outside the sets rfb/keysym.h defines */
+#define KEYSYM_HANGUL		0xff31
+#define KEYSYM_HANGUL_HANJA	0xff34
+#define KEYSYM_AUDIO_LOWER	0x1008ff11
+#define KEYSYM_AUDIO_MUTE	0x1008ff12
+#define KEYSYM_AUDIO_RAISE	0x1008ff13
+#define KEYSYM_POWER_OFF	0x1008ff2a
+
+/* QEMU Extended Key Event: raw XT scancodes alongside the keysym */
+#define RFB_QEMU_MSG		255
+#define RFB_QEMU_EXT_KEY	0
+#define RFB_ENCODING_QEMU_KEY	-258
+
+#define REFINE_OFF		0
+#define REFINE_MOTION		1
+#define REFINE_SETTLE		2
+#define REFINE_IDLE		3
+#define REFINE_SETTLE_FRAMES	2
+
+#define SCHED_ROLE_CAPTURE	0
+#define SCHED_ROLE_RFB		1
+#define SCHED_ROLES		2
+
+#define TRACE_FMT		0
+#define TRACE_READ		1
+#define TRACE_SEND		2
+#define TRACE_FLUSH		3
+
+#define VIDEO_DOWN		0
+#define VIDEO_NO_SIGNAL		1
+#define VIDEO_STREAMING		2
+
+/* get_frame() went through without a new frame to pass on */
+#define FRAME_NONE		1
 
 static volatile bool ok = true;
+static volatile bool dump_stats = false;
+static volatile bool dump_trace = false;
 pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Keyboard report state, shared by the rfb and macro threads */
+pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Held by the capture thread across its walks of the client list */
+pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* VeNCrypt handshakes done by their own threads, for the rfb thread */
+pthread_mutex_t tls_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct resolution {
 	size_t height;
 	size_t width;
 };
 
+struct sched_config {
+	bool set;
+	bool cpus_set;
+	int policy;
+	int prio;
+	cpu_set_t cpus;
+};
+
+struct jitter {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long sum_sq;
+	unsigned long long min;
+	unsigned long long max;
+	struct timespec last;
+};
+
+/*
+ * Frame export memfd layout, shared with local consumers: this header, then
+ * slots of slot_size bytes, each a struct export_slot followed by a frame as
+ * read from the engine. A consumer takes the slot of the latest seq, modulo
+ * slots, and the frame in it is good if the slot's seq still matches after
+ * it's done with it. size grows, never shrinks; remap when it changes.
+ */
+struct export_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint64_t size;
+	uint64_t seq;
+};
+
+struct export_slot {
+	uint64_t seq;
+	uint64_t timestamp_ns;
+	uint32_t width;
+	uint32_t height;
+	uint32_t flags;
+	uint32_t len;
+	char backend[8];
+};
+
+/*
+ * One outbound connection to an aggregator that looks like a listening
+ * viewer; it fans frames out to the real viewers and multiplexes their input
+ * back as ordinary RFB events.
+ */
+struct relay {
+	char *spec;
+	char *host;
+	char *port;
+	int fd;
+	int dns;
+	int dns_rc;
+	struct addrinfo *res;
+	unsigned int retry_ms;
+	unsigned long long retry_ns;
+	rfbClientPtr cl;
+};
+
+/*
+ * Dashboards connect to a separate screen on its own port, a fraction of
+ * the size of the real one and refreshed once per interval from frames that
+ * were captured anyway; libvncserver serves it like any other screen.
+ */
+struct thumb {
+	int port;
+	int scale;
+	int width;
+	int height;
+	char *fb;
+	unsigned long long seq;
+	unsigned long long next_ns;
+	rfbScreenInfoPtr server;
+};
+
+struct frame_export {
+	int fd;
+	int ro_fd;
+	int listen_fd;
+	int num_consumers;
+	int consumers[EXPORT_MAX_CONSUMERS];
+	const char *path;
+	struct export_header *header;
+};
+
+/*
+ * Screen activity for automation, worked out from frames captured anyway
+ * and sent as one text line per message to everyone connected to a
+ * SOCK_SEQPACKET socket at path; being connected keeps frames coming.
+ */
+struct events {
+	int listen_fd;
+	int num_subscribers;
+	int subscribers[EVENTS_MAX_SUBSCRIBERS];
+	const char *path;
+	bool signal;
+	bool stable;
+	unsigned int stable_ms;
+	unsigned int hash;
+	size_t width;
+	size_t height;
+	unsigned long long change_ns;
+};
+
+/* One step of a macro: keys pressed together, released in reverse */
+struct macro_key {
+	unsigned int num;
+	rfbKeySym keysyms[MACRO_MAX_CHORD];
+};
+
+/*
+ * Key sequences typed by the daemon itself on a local controller's
+ * command, so that hitting a key during POST is timed by the BMC rather
+ * than by the network. The macro thread writes the reports as each press
+ * or release falls due, a sequence at a time and repeated every_ns until
+ * end_ns; the first may wait for the screen to be stable.
+ */
+struct macro {
+	int listen_fd;
+	int num_controllers;
+	int controllers[MACRO_MAX_CONTROLLERS];
+	int owner;
+	const char *path;
+	int state;
+	unsigned int num_keys;
+	struct macro_key keys[MACRO_MAX_KEYS];
+	unsigned int step;
+	bool pressed;
+	unsigned long long every_ns;
+	unsigned long long duration_ns;
+	unsigned long long start_ns;
+	unsigned long long end_ns;
+};
+
+/* A client whose VeNCrypt handshake is running, or done, on its own thread */
+struct tls_handshake {
+	rfbClientPtr cl;
+	int rc;
+	struct tls_handshake *next;
+};
+
+/* Frame slots on an absolute monotonic grid and how well they were kept */
+struct pacing {
+	unsigned long long period_ns;
+	unsigned long long deadline_ns;
+	unsigned long long slots;
+	unsigned long long late;
+	unsigned long long skipped;
+	unsigned long long late_sum_ns;
+	unsigned long long late_max_ns;
+};
+
+struct trace_event {
+	unsigned int frame_id;
+	unsigned short stage;
+	short client;
+	unsigned int size;
+	unsigned long long start_ns;
+	unsigned long long end_ns;
+};
+
+/*
+ * Ring of per-frame trace events. Only the capture thread writes to it, so
+ * recording an event is a couple of stores and a clock read.
+ */
+struct trace {
+	unsigned int num_events;
+	unsigned long long idx;
+	struct trace_event *events;
+};
+
+struct obmc_ikvm;
+
+/*
+ * A capture backend knows the layout of what the engine's read() returns:
+ * parse() digests a freshly read frame and send() writes what one client is
+ * missing to it, returning the bytes sent, 0 if it had nothing new or -1.
+ */
+struct video_backend {
+	const char *name;
+	int (*parse)(struct obmc_ikvm *ikvm);
+	int (*send)(rfbClientPtr cl, struct obmc_ikvm *ikvm);
+};
+
+/* One rectangle, header included, of a frame from a rect-list engine */
+struct video_rect {
+	unsigned short x;
+	unsigned short y;
+	unsigned short w;
+	unsigned short h;
+	unsigned int encoding;
+	unsigned int offset;
+	unsigned int len;
+	unsigned int hash;
+	bool changed;
+};
+
+/*
+ * Latest content of each rectangle geometry, stamped with a sequence number
+ * that grows every time any rect changes. Clients remember the sequence they
+ * were last brought up to, so one that skipped frames gets what changed since.
+ */
+struct rect_entry {
+	unsigned long long key;
+	unsigned long long seq;
+	unsigned int hash;
+	unsigned int len;
+	unsigned int size;
+	char *data;
+};
+
+/* What we put in the fences we send; the client echoes it back untouched */
+struct flow_fence {
+	unsigned long long sent_ns;
+	unsigned long long sent_bytes;
+};
+
+/*
+ * Clients that speak the Fence extension get a fence after every update.
+ * Its reply tells how much of what we sent has been processed and how long
+ * that took, which sizes the window of data allowed in flight.
+ */
+struct flow {
+	bool fence;
+	bool cu;
+	bool continuous;
+	bool window_full;
+	unsigned int window;
+	unsigned long long sent_bytes;
+	unsigned long long acked_bytes;
+	unsigned long long rtt_ns;
+};
+
+/* What serving one client has cost, for SIGUSR1 and when it leaves */
+struct client_stats {
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long cpu_ns;
+	unsigned long long backlogs;
+	unsigned long long backlog_ns;
+	int queued_max;
+};
+
+/*
+ * Progressive refinement for engines with a JPEG quality control: stream at
+ * the motion quality, and once the picture has held still for static_ms,
+ * switch to the best quality and send a single refresh. Frames that match
+ * the refresh aren't sent again to clients that have it.
+ */
+struct refine {
+	int state;
+	int settle;
+	bool refreshed;
+	int low;
+	int high;
+	unsigned int static_ms;
+	unsigned int hash;
+	unsigned long long change_ns;
+};
+
+/*
+ * Input to display self-test: inject a pointer move or a key press the way a
+ * client's event comes in, then time it through the gadget report, the first
+ * frame captured after that which changed, and that frame being sent.
+ */
+struct latency {
+	unsigned int probes;
+	rfbKeySym keysym;
+	rfbClientPtr cl;
+	int state;
+	bool key_down;
+	bool flip;
+	unsigned int num;
+	unsigned int lost;
+	unsigned int hash;
+	unsigned long long next_ns;
+	unsigned long long inject_ns;
+	unsigned long long report_ns;
+	unsigned long long capture_ns;
+	unsigned long long *total;
+	unsigned long long *report;
+	unsigned long long *capture;
+	unsigned long long *send;
+};
+
+/*
+ * Frames saved with -d played back in place of a video device, moving on to
+ * the next one for every batch of reports written, like a host responding
+ * to input.
+ */
+struct playback {
+	const char *dir;
+	bool mode_change;
+	unsigned int num_frames;
+	unsigned int index;
+	unsigned int reports;
+};
+
+/*
+ * Soak test: cycle viewer connections with input bursts, and mode changes,
+ * through the unix socket against the playback source and a mock gadget,
+ * recording memory, descriptors, update latency and CPU for every cycle.
+ */
+struct soak {
+	unsigned int cycles;
+	int rc;
+	int gadget_fd;
+	long *rss_kb;
+	int *fds;
+	unsigned long long *latency;
+	unsigned long long *cpu;
+};
+
+/*
+ * The part of the screen a client asks for when its update requests don't
+ * cover all of it. On the rect engine it gets the rects there with every
+ * frame and the rest of the screen only every ROI_REST_MS.
+ */
+struct roi {
+	unsigned short x;
+	unsigned short y;
+	unsigned short w;
+	unsigned short h;
+};
+
+struct ikvm_client {
+	struct obmc_ikvm *ikvm;
+	bool needs_full;
+	bool refined;
+	bool spectator;
+	bool has_roi;
+	struct roi roi;
+	unsigned long long roi_seq;
+	unsigned long long rest_ns;
+	volatile bool update_pending;
+	unsigned long long seq;
+	unsigned int fb_seq;
+	pthread_mutex_t send_lock;
+	struct flow flow;
+	struct client_stats stats;
+};
+
 struct obmc_ikvm {
 	bool dont_wait;
+	bool lock_memory;
+	bool no_signal_shown;
+	bool reset_video;
+	bool video_fresh;
+	bool frame_is_full;
+	bool rect_cache_valid;
 	bool dump_frames;
 	bool send_ptr;
 	bool send_report;
 	bool wait_next;
 	int delay_count;
 	int num_clients;
+	int num_spectators;
+	int max_clients;
+	int max_spectators;
+	int max_queued;
 	int videodev_fd;
 	int frame_size;
 	int frame_buf_size;
+	size_t fb_size;
+	unsigned int fb_seq;
+	unsigned int frame_id;
+	int video_state;
+	int video_retry_ms;
+	unsigned long long video_retry_ns;
 	int input_fd;
 	int keyboard_fd;
 	int ptr_fd;
 	int dump_frame_idx;
 	int frame_rate;
+	unsigned long long max_latency_ns;
+	int motion_quality;
 	int frame_time_us;
 	int process_events_time_us;
 	size_t report_size;
+	size_t ptr_size;
+	int ptr_mask;
+	unsigned int ptr_reports;
+	unsigned long long ptr_interval_ns;
+	unsigned long long ptr_sent_ns;
 	int nRects;
+	unsigned int num_rects;
+	unsigned int num_changed;
+	unsigned int rects_size;
+	unsigned int rect_table_size;
+	unsigned int rect_table_used;
+	unsigned int sorted_size;
+	unsigned long long rect_seq;
+	unsigned long long frame_seq;
+	size_t rect_cache_bytes;
+	struct video_rect *rects;
+	struct rect_entry *rect_table;
+	struct rect_entry **sorted;
+	unsigned long long *tile_seq;
+	unsigned int tiles_w;
+	unsigned int tiles_h;
+	const struct video_backend *backend;
 	struct resolution resolution;
+	char *fb;
 	char *frame;
 	char *input_name;
 	char *keyboard_name;
 	char *ptr_name;
 	char *videodev_name;
-	char ptr[PTR_SIZE];
+	char *tls_cert;
+	char *tls_key;
+#ifdef _TLS_
+	SSL_CTX *tls_ctx;
+	struct tls_handshake *tls_done;
+#endif /* _TLS_ */
+	char ptr[PTR_SIZE + 1];
 	unsigned char report[REPORT_SIZE];
-	unsigned short report_map[REPORT_SIZE - 2];
+	unsigned char mods;
+	bool report_shift[REPORT_SIZE - 2];
+	struct sched_config sched[SCHED_ROLES];
+	struct jitter jitter[SCHED_ROLES];
+	struct pacing pacing;
+	struct refine refine;
+	struct latency latency;
+	struct playback playback;
+	struct soak soak;
+	unsigned int reports;
+	struct frame_export export;
+	struct events events;
+	struct macro macro;
+	struct relay relay;
+	struct thumb thumb;
+	int unix_fd;
+	const char *unix_path;
+	struct trace trace;
+	FILE *record_file;
+	unsigned long long record_start_ns;
 	rfbScreenInfoPtr server;
 };
 
+static const struct video_backend opaque_backend;
+static const struct video_backend rects_backend;
+
+static const char *sched_role_names[SCHED_ROLES] = {
+	"capture",
+	"rfb",
+};
+
 static void int_handler(int sig)
 {
 	ok = false;
 }
 
-static int alloc_frame(struct obmc_ikvm *ikvm, struct v4l2_format *fmt)
+static void usr1_handler(int sig)
 {
-	ikvm->resolution.height = fmt->fmt.pix.height;
-	ikvm->resolution.width = fmt->fmt.pix.width;
+	dump_stats = true;
+}
 
-	ikvm->frame_buf_size = ikvm->resolution.height *
-		ikvm->resolution.width * BYTES_PER_PIXEL;
+static void usr2_handler(int sig)
+{
+	dump_trace = true;
+}
 
-	if (!ikvm->frame_buf_size) {
-		printf("resolution invalid\n");
-		return -ENOMEM;
-	}
+static const char *trace_stage_names[] = {
+	"fmt",
+	"read",
+	"send",
+	"flush",
+};
 
-	ikvm->frame = (char *)malloc(ikvm->frame_buf_size);
-	if (!ikvm->frame) {
-		printf("failed to allocate buffer\n");
-		return -ENOMEM;
-	}
+static unsigned long long now_ns(void)
+{
+	struct timespec now;
 
-	DBG("frame buffer size: %d\n", ikvm->frame_buf_size);
-	memset(ikvm->frame, 0, ikvm->frame_buf_size);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	return 0;
+	return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
 }
 
-static void set_frame_rate(struct obmc_ikvm *ikvm)
+/* CPU time of the calling thread */
+static unsigned long long thread_cpu_ns(void)
 {
-	int rc;
-	struct v4l2_streamparm sparm;
+	struct timespec now;
 
-	sparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	sparm.parm.capture.timeperframe.numerator = 1;
-	sparm.parm.capture.timeperframe.denominator = ikvm->frame_rate;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
 
-	rc = ioctl(ikvm->videodev_fd, VIDIOC_S_PARM, &sparm);
-	if (rc < 0)
-		printf("failed to set framerate; ignoring: %d %s\n", errno,
-		       strerror(errno));
+	return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
 }
 
-static int init_videodev(struct obmc_ikvm *ikvm)
+static int init_trace(struct trace *trace, unsigned int num_events)
 {
-	int rc;
-	struct v4l2_capability cap;
-        struct v4l2_format fmt;
-	struct v4l2_streamparm sparm;
-
-	ikvm->videodev_fd = open(ikvm->videodev_name, O_RDWR);
-	if (ikvm->videodev_fd < 0) {
-		/* VGA may have gone to sleep? Try and wake it up */
-		if (ikvm->input_name) {
-			int tmp_fd = open(ikvm->input_name, O_RDWR);
+	trace->events = calloc(num_events, sizeof(struct trace_event));
+	if (!trace->events) {
+		printf("failed to allocate trace buffer\n");
+		return -ENOMEM;
+	}
 
-			if (tmp_fd >= 0) {
-				struct timespec dur;
-				short xx = 0x3FFF;
-				char rpt[PTR_SIZE + 1];
+	trace->num_events = num_events;
 
-				dur.tv_sec = 0;
-				dur.tv_nsec =
-					ikvm->process_events_time_us * 1000;
+	return 0;
+}
 
-				memset(rpt, 0, PTR_SIZE + 1);
-				rpt[0] = 2;
-				memcpy(&rpt[2], &xx, 2);
+/* Record a stage of the current frame that started at start_ns and ends now */
+static void trace_frame(struct obmc_ikvm *ikvm, int stage, int client,
+			unsigned int size, unsigned long long start_ns)
+{
+	struct trace_event *ev;
+	struct trace *trace = &ikvm->trace;
 
-				rc = write(tmp_fd, rpt, PTR_SIZE + 1);
-				if (rc == PTR_SIZE + 1) {
-					nanosleep(&dur, NULL);
+	if (!trace->events)
+		return;
 
-					memset(&rpt[1], 0, PTR_SIZE);
-					write(tmp_fd, rpt, PTR_SIZE + 1);
-				}
+	ev = &trace->events[trace->idx++ % trace->num_events];
+	ev->frame_id = ikvm->frame_id;
+	ev->stage = stage;
+	ev->client = client;
+	ev->size = size;
+	ev->start_ns = start_ns;
+	ev->end_ns = now_ns();
+}
 
-				close(tmp_fd);
-			}
-		}
+/* Write the trace ring out in the Chrome trace event format */
+static void write_trace(struct obmc_ikvm *ikvm)
+{
+	FILE *f;
+	unsigned long long i;
+	struct trace *trace = &ikvm->trace;
+	unsigned long long first = 0;
 
-		ikvm->videodev_fd = open(ikvm->videodev_name, O_RDWR);
-		if (ikvm->videodev_fd < 0) {
-			printf("failed to open %s: %d %s\n",
-			       ikvm->videodev_name, errno, strerror(errno));
-			return -ENODEV;
-		}
-	}
+	if (!trace->events)
+		return;
 
-	rc = ioctl(ikvm->videodev_fd, VIDIOC_QUERYCAP, &cap);
-	if (rc < 0) {
-		printf("failed to query capabilities: %d %s\n", errno,
+	f = fopen(TRACE_FILE, "w");
+	if (!f) {
+		printf("failed to open %s: %d %s\n", TRACE_FILE, errno,
 		       strerror(errno));
-		return -EINVAL;
-	}
-
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
-	    !(cap.capabilities & V4L2_CAP_READWRITE)) {
-		printf("device doesn't support this application\n");
-		return -EOPNOTSUPP;
+		return;
 	}
 
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
-	if (rc < 0) {
-		printf("failed to query format: %d %s\n", errno,
-		       strerror(errno));
-		return -EINVAL;
+	if (trace->idx > trace->num_events)
+		first = trace->idx - trace->num_events;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (i = first; i < trace->idx; ++i) {
+		struct trace_event *ev = &trace->events[i % trace->num_events];
+
+		fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\","
+			"\"pid\":1,\"tid\":%d,\"ts\":%llu.%03llu,"
+			"\"dur\":%llu.%03llu,\"args\":{\"frame\":%u,"
+			"\"bytes\":%u}}\n", i == first ? "" : ",",
+			trace_stage_names[ev->stage], ev->client + 1,
+			ev->start_ns / 1000, ev->start_ns % 1000,
+			(ev->end_ns - ev->start_ns) / 1000,
+			(ev->end_ns - ev->start_ns) % 1000, ev->frame_id,
+			ev->size);
 	}
+	fprintf(f, "]}\n");
 
-	set_frame_rate(ikvm);
-
-	return alloc_frame(ikvm, &fmt);
+	fclose(f);
+	printf("wrote %llu trace events to %s\n", trace->idx - first,
+	       TRACE_FILE);
 }
 
-static unsigned char key_to_mod(rfbKeySym key)
+static int parse_cpus(cpu_set_t *cpus, const char *str)
 {
-	unsigned char mod = 0;
+	char *end;
+	long first;
+	long last;
+
+	CPU_ZERO(cpus);
+
+	while (*str) {
+		first = strtol(str, &end, 10);
+		if (end == str || first < 0 || first >= CPU_SETSIZE)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first || last >= CPU_SETSIZE)
+				return -EINVAL;
+		}
 
-	if (key >= XK_Shift_L && key <= XK_Control_R) {
-		static const unsigned char map[] = {
-			0x02,	// left shift
-			0x20,	// right shift
-			0x01,	// left control
-			0x10	// right control
-		};
+		for (; first <= last; ++first)
+			CPU_SET(first, cpus);
 
-		mod = map[key - XK_Shift_L];
-	} else if (key >= XK_Meta_L && key <= XK_Alt_R) {
-		static const unsigned char map[] = {
-			0x08,	// left meta
-			0x80,	// right meta
-			0x04,	// left alt
-			0x40	// right alt
-		};
+		if (*end == ',')
+			++end;
+		else if (*end)
+			return -EINVAL;
 
-		mod = map[key - XK_Meta_L];
+		str = end;
 	}
 
-	return mod;
+	return 0;
 }
 
-static char key_to_scancode(rfbKeySym key)
+/*
+ * Parse a scheduling option of the form role=policy[:prio][@cpus], where
+ * role is "capture" or "rfb", policy is "fifo", "rr" or "other", prio is the
+ * real-time priority (fifo, rr) or nice value (other) and cpus is a cpu list
+ * such as "0" or "0,2-3".
+ */
+static int parse_sched(struct obmc_ikvm *ikvm, const char *arg)
 {
-	char scancode = 0;
+	int i;
+	int rc;
+	char *at;
+	char *colon;
+	char *end;
+	char *eq;
+	char *str;
+	struct sched_config *sc = NULL;
+
+	str = strdup(arg);
+	if (!str)
+		return -ENOMEM;
 
-	if ((key >= 'A' && key <= 'Z') || (key >= 'a' && key <= 'z')) {
-		scancode = USBHID_KEY_A + ((key & 0x5F) - 'A');
-	} else if (key >= '1' && key <= '9') {
-		scancode = USBHID_KEY_1 + (key - '1');
-	} else if (key >= XK_F1 && key <= XK_F12) {
-		scancode = USBHID_KEY_F1 + (key - XK_F1);
-	} else {
-		switch (key) {
-		case XK_exclam:
-			scancode = USBHID_KEY_1;
-			break;
-		case XK_at:
-			scancode = USBHID_KEY_2;
-			break;
-		case XK_numbersign:
-			scancode = USBHID_KEY_3;
-			break;
-		case XK_dollar:
-			scancode = USBHID_KEY_4;
-			break;
-		case XK_percent:
-			scancode = USBHID_KEY_5;
-			break;
-		case XK_asciicircum:
-			scancode = USBHID_KEY_6;
-			break;
-		case XK_ampersand:
-			scancode = USBHID_KEY_7;
-			break;
-		case XK_asterisk:
-			scancode = USBHID_KEY_8;
-			break;
-		case XK_parenleft:
-			scancode = USBHID_KEY_9;
-			break;
-		case XK_0:
-		case XK_parenright:
-			scancode = USBHID_KEY_0;
-			break;
-		case XK_Return:
-			scancode = USBHID_KEY_RETURN;
-			break;
-		case XK_Escape:
-			scancode = USBHID_KEY_ESC;
-			break;
-		case XK_BackSpace:
-			scancode = USBHID_KEY_BACKSPACE;
-			break;
-		case XK_Tab:
-			scancode = USBHID_KEY_TAB;
-			break;
-		case XK_space:
-			scancode = USBHID_KEY_SPACE;
-			break;
-		case XK_minus:
-		case XK_underscore:
-			scancode = USBHID_KEY_MINUS;
-			break;
-		case XK_plus:
-		case XK_equal:
-			scancode = USBHID_KEY_EQUAL;
-			break;
-		case XK_bracketleft:
-		case XK_braceleft:
-			scancode = USBHID_KEY_LEFTBRACE;
-			break;
-		case XK_bracketright:
-		case XK_braceright:
-			scancode = USBHID_KEY_RIGHTBRACE;
-			break;
-		case XK_backslash:
-		case XK_bar:
-			scancode = USBHID_KEY_BACKSLASH;
-			break;
-		case XK_colon:
-		case XK_semicolon:
-			scancode = USBHID_KEY_SEMICOLON;
-			break;
-		case XK_quotedbl:
-		case XK_apostrophe:
-			scancode = USBHID_KEY_APOSTROPHE;
-			break;
-		case XK_grave:
-		case XK_asciitilde:
-			scancode = USBHID_KEY_GRAVE;
-			break;
-		case XK_comma:
-		case XK_less:
-			scancode = USBHID_KEY_COMMA;
-			break;
-		case XK_period:
-		case XK_greater:
-			scancode = USBHID_KEY_DOT;
-			break;
-		case XK_slash:
-		case XK_question:
-			scancode = USBHID_KEY_SLASH;
-			break;
-		case XK_Caps_Lock:
-			scancode = USBHID_KEY_CAPSLOCK;
-			break;
-		case XK_Print:
-			scancode = USBHID_KEY_PRINT;
-			break;
-		case XK_Scroll_Lock:
-			scancode = USBHID_KEY_SCROLLLOCK;
-			break;
-		case XK_Pause:
-			scancode = USBHID_KEY_PAUSE;
-			break;
-		case XK_Insert:
-			scancode = USBHID_KEY_INSERT;
-			break;
-		case XK_Home:
-			scancode = USBHID_KEY_HOME;
-			break;
-		case XK_Page_Up:
-			scancode = USBHID_KEY_PAGEUP;
-			break;
-		case XK_Delete:
-			scancode = USBHID_KEY_DELETE;
-			break;
-		case XK_End:
-			scancode = USBHID_KEY_END;
-			break;
-		case XK_Page_Down:
-			scancode = USBHID_KEY_PAGEDOWN;
-			break;
-		case XK_Right:
-			scancode = USBHID_KEY_RIGHT;
-			break;
-		case XK_Left:
-			scancode = USBHID_KEY_LEFT;
-			break;
-		case XK_Down:
-			scancode = USBHID_KEY_DOWN;
-			break;
-		case XK_Up:
-			scancode = USBHID_KEY_UP;
-			break;
-		case XK_Num_Lock:
-			scancode = USBHID_KEY_NUMLOCK;
-			break;
-		}
+	eq = strchr(str, '=');
+	if (!eq) {
+		rc = -EINVAL;
+		goto done;
 	}
 
-	return scancode;
-}
+	*eq++ = '\0';
 
-static void key_event(rfbBool down, rfbKeySym key, rfbClientPtr cl)
-{
-	struct obmc_ikvm *ikvm = cl->screen->screenData;
+	for (i = 0; i < SCHED_ROLES; ++i) {
+		if (!strcmp(str, sched_role_names[i])) {
+			sc = &ikvm->sched[i];
+			break;
+		}
+	}
 
-	DBG("key event %s %x\n", down ? "down" : "up", key);
+	if (!sc) {
+		rc = -EINVAL;
+		goto done;
+	}
 
-	if (down) {
-		char sc = key_to_scancode(key);
+	at = strchr(eq, '@');
+	if (at) {
+		*at++ = '\0';
 
-		if (sc) {
-			unsigned int i;
+		rc = parse_cpus(&sc->cpus, at);
+		if (rc)
+			goto done;
 
-			for (i = 2; i < ikvm->report_size; ++i) {
-				if (!ikvm->report[i]) {
-					ikvm->report[i] = sc;
-					ikvm->report_map[i - 2] = key;
-					goto update_send_report;
-				}
-			}
+		sc->cpus_set = true;
+	}
 
-			DBG("no space in report for additional key press!\n");
-			return;
-		} else {
-			unsigned char mod = key_to_mod(key);
+	colon = strchr(eq, ':');
+	if (colon)
+		*colon++ = '\0';
+
+	if (!strcmp(eq, "fifo"))
+		sc->policy = SCHED_FIFO;
+	else if (!strcmp(eq, "rr"))
+		sc->policy = SCHED_RR;
+	else if (!strcmp(eq, "other"))
+		sc->policy = SCHED_OTHER;
+	else if (*eq || !sc->cpus_set) {
+		rc = -EINVAL;
+		goto done;
+	}
 
-			if (mod) {
-				ikvm->report[0] |= mod;
-				goto update_send_report;
-			}
+	if (*eq)
+		sc->set = true;
 
-			return;
+	sc->prio = sc->policy == SCHED_OTHER ? 0 :
+		sched_get_priority_min(sc->policy);
+	if (colon) {
+		sc->prio = (int)strtol(colon, &end, 0);
+		if (end == colon || *end) {
+			rc = -EINVAL;
+			goto done;
 		}
-	} else {
-		unsigned char mod;
-		unsigned int i;
+	}
 
-		for (i = 0; i < ikvm->report_size - 2; ++i) {
-			if (ikvm->report_map[i] == key) {
-				ikvm->report_map[i] = 0;
-				ikvm->report[i + 2] = 0;
-				goto update_send_report;
+	rc = 0;
+
+done:
+	free(str);
+	return rc;
+}
+
+/* Apply the configured scheduling policy to the calling thread */
+static void apply_sched(struct obmc_ikvm *ikvm, int role)
+{
+	int rc;
+	struct sched_param param;
+	struct sched_config *sc = &ikvm->sched[role];
+
+	if (sc->cpus_set) {
+		rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+					    &sc->cpus);
+		if (rc)
+			printf("failed to set %s cpu affinity: %d %s\n",
+			       sched_role_names[role], rc, strerror(rc));
+	}
+
+	if (!sc->set)
+		return;
+
+	memset(&param, 0, sizeof(param));
+	if (sc->policy != SCHED_OTHER)
+		param.sched_priority = sc->prio;
+
+	rc = pthread_setschedparam(pthread_self(), sc->policy, &param);
+	if (rc) {
+		printf("failed to set %s scheduling policy: %d %s\n",
+		       sched_role_names[role], rc, strerror(rc));
+		return;
+	}
+
+	if (sc->policy == SCHED_OTHER &&
+	    setpriority(PRIO_PROCESS, syscall(SYS_gettid), sc->prio))
+		printf("failed to set %s nice value: %d %s\n",
+		       sched_role_names[role], errno, strerror(errno));
+}
+
+/* Record the time since the previous iteration of a thread's loop */
+static void jitter_sample(struct jitter *j)
+{
+	unsigned long long usec;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (j->last.tv_sec || j->last.tv_nsec) {
+		usec = (now.tv_sec - j->last.tv_sec) * 1000000ULL;
+		usec += now.tv_nsec / 1000;
+		usec -= j->last.tv_nsec / 1000;
+
+		if (!j->count || usec < j->min)
+			j->min = usec;
+		if (usec > j->max)
+			j->max = usec;
+
+		j->count++;
+		j->sum += usec;
+		j->sum_sq += usec * usec;
+	}
+
+	j->last = now;
+}
+
+static unsigned long long isqrt(unsigned long long n)
+{
+	unsigned long long x = n;
+	unsigned long long y = (x + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+
+	return x;
+}
+
+static void print_jitter(struct obmc_ikvm *ikvm)
+{
+	int i;
+
+	for (i = 0; i < SCHED_ROLES; ++i) {
+		struct jitter *j = &ikvm->jitter[i];
+		unsigned long long avg;
+		unsigned long long dev;
+
+		if (!j->count)
+			continue;
+
+		avg = j->sum / j->count;
+		dev = isqrt((j->sum_sq / j->count) - (avg * avg));
+
+		printf("%s loop period (us): avg %llu min %llu max %llu "
+		       "stddev %llu samples %llu\n", sched_role_names[i],
+		       avg, j->min, j->max, dev, j->count);
+	}
+}
+
+static void init_pacing(struct pacing *p, int frame_rate)
+{
+	memset(p, 0, sizeof(*p));
+	p->period_ns = 1000000000ULL / frame_rate;
+	p->deadline_ns = now_ns() + p->period_ns;
+}
+
+/*
+ * Sleep until the next frame slot. Slots sit on a fixed grid of absolute
+ * deadlines so the time spent capturing and sending doesn't push later
+ * frames back. A slot missed by less than a period still runs, late, and
+ * the grid catches up; slots missed entirely are skipped instead of being
+ * run back to back.
+ */
+static void wait_pacing(struct pacing *p)
+{
+	unsigned long long late;
+	unsigned long long now = now_ns();
+	struct timespec deadline;
+
+	if (now >= p->deadline_ns + p->period_ns) {
+		unsigned long long missed = (now - p->deadline_ns) /
+			p->period_ns;
+
+		p->skipped += missed;
+		p->deadline_ns += missed * p->period_ns;
+	}
+
+	deadline.tv_sec = p->deadline_ns / 1000000000ULL;
+	deadline.tv_nsec = p->deadline_ns % 1000000000ULL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+			       NULL) == EINTR && ok)
+		;
+
+	now = now_ns();
+	late = now > p->deadline_ns ? now - p->deadline_ns : 0;
+
+	p->slots++;
+	p->late_sum_ns += late;
+	if (late > p->late_max_ns)
+		p->late_max_ns = late;
+	if (late > p->period_ns / PACING_LATE_DIV)
+		p->late++;
+
+	p->deadline_ns += p->period_ns;
+}
+
+static void print_pacing(struct obmc_ikvm *ikvm)
+{
+	struct pacing *p = &ikvm->pacing;
+
+	if (!p->slots)
+		return;
+
+	printf("capture pacing (us): target %llu late avg %llu max %llu; "
+	       "slots %llu late %llu skipped %llu\n", p->period_ns / 1000,
+	       p->late_sum_ns / p->slots / 1000, p->late_max_ns / 1000,
+	       p->slots, p->late, p->skipped);
+}
+
+/*
+ * Grow the capture buffer to hold size bytes of compressed frame. The buffer
+ * only ever holds the engine's bitstream, so it's sized from the format's
+ * sizeimage rather than the resolution.
+ */
+static int alloc_frame(struct obmc_ikvm *ikvm, size_t size)
+{
+	char *frame;
+
+	if (size <= ikvm->frame_buf_size)
+		return 0;
+
+	frame = (char *)realloc(ikvm->frame, size);
+	if (!frame) {
+		printf("failed to allocate buffer\n");
+		return -ENOMEM;
+	}
+
+	ikvm->frame = frame;
+	ikvm->frame_buf_size = size;
+
+	DBG("frame buffer size: %d\n", ikvm->frame_buf_size);
+
+	if (ikvm->lock_memory && mlock(ikvm->frame, ikvm->frame_buf_size))
+		printf("failed to lock frame buffer: %d %s\n", errno,
+		       strerror(errno));
+
+	return 0;
+}
+
+/* Compressed frames are never bigger than sizeimage, if the driver sets it */
+static size_t fmt_frame_size(struct v4l2_format *fmt)
+{
+	if (fmt->fmt.pix.sizeimage)
+		return fmt->fmt.pix.sizeimage;
+
+	return fmt->fmt.pix.height * fmt->fmt.pix.width * BYTES_PER_PIXEL;
+}
+
+/*
+ * Map the framebuffer libvncserver is given for the resolution. The pixels in
+ * it are never drawn, so it is an anonymous mapping that only takes up memory
+ * for the pages libvncserver writes to. The previous mapping is left for the
+ * caller to unmap once libvncserver has let go of it.
+ */
+static int alloc_fb(struct obmc_ikvm *ikvm, size_t width, size_t height)
+{
+	size_t size = height * width * BYTES_PER_PIXEL;
+	void *fb;
+
+	if (!size) {
+		printf("resolution invalid\n");
+		return -ENOMEM;
+	}
+
+	fb = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (fb == MAP_FAILED) {
+		printf("failed to map framebuffer: %d %s\n", errno,
+		       strerror(errno));
+		return -ENOMEM;
+	}
+
+	ikvm->resolution.height = height;
+	ikvm->resolution.width = width;
+	ikvm->fb = (char *)fb;
+	ikvm->fb_size = size;
+
+	return 0;
+}
+
+/*
+ * Open a HID gadget device. A name of the form unix:path connects to a
+ * SOCK_SEQPACKET socket instead, so that a mock gadget can receive the
+ * reports with their boundaries intact.
+ */
+static int open_hid(const char *name)
+{
+	int fd;
+	struct sockaddr_un addr;
+	size_t len = strlen(HID_UNIX_PREFIX);
+
+	if (strncmp(name, HID_UNIX_PREFIX, len))
+		return open(name, O_RDWR);
+
+	if (strlen(name + len) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, name + len);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static void set_frame_rate(struct obmc_ikvm *ikvm)
+{
+	int rc;
+	struct v4l2_streamparm sparm;
+
+	sparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sparm.parm.capture.timeperframe.numerator = 1;
+	sparm.parm.capture.timeperframe.denominator = ikvm->frame_rate;
+
+	rc = ioctl(ikvm->videodev_fd, VIDIOC_S_PARM, &sparm);
+	if (rc < 0)
+		printf("failed to set framerate; ignoring: %d %s\n", errno,
+		       strerror(errno));
+}
+
+static int set_quality(struct obmc_ikvm *ikvm, int quality)
+{
+	struct v4l2_control ctrl = {
+		.id = V4L2_CID_JPEG_COMPRESSION_QUALITY,
+		.value = quality,
+	};
+
+	if (ioctl(ikvm->videodev_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+		printf("failed to set jpeg quality %d: %d %s\n", quality,
+		       errno, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* The device was (re)opened, so start over streaming at motion quality */
+static void init_refine(struct obmc_ikvm *ikvm, int quality)
+{
+	struct refine *r = &ikvm->refine;
+	struct v4l2_queryctrl qc = {
+		.id = V4L2_CID_JPEG_COMPRESSION_QUALITY,
+	};
+
+	r->state = REFINE_OFF;
+
+	if (ioctl(ikvm->videodev_fd, VIDIOC_QUERYCTRL, &qc) < 0 ||
+	    (qc.flags & V4L2_CTRL_FLAG_DISABLED)) {
+		printf("%s has no jpeg quality control; not refining\n",
+		       ikvm->videodev_name);
+		return;
+	}
+
+	r->high = qc.maximum;
+	r->low = qc.default_value;
+	if (quality >= 0)
+		r->low = quality < qc.minimum ? qc.minimum :
+			quality > qc.maximum ? qc.maximum : quality;
+
+	if (set_quality(ikvm, r->low))
+		return;
+
+	r->state = REFINE_MOTION;
+	r->hash = 0;
+	r->change_ns = now_ns();
+}
+
+static int init_playback(struct obmc_ikvm *ikvm)
+{
+	char path[256];
+	struct playback *p = &ikvm->playback;
+
+	p->dir = ikvm->videodev_name + strlen(PLAYBACK_PREFIX);
+	p->index = 0;
+	p->reports = __atomic_load_n(&ikvm->reports, __ATOMIC_ACQUIRE);
+
+	for (p->num_frames = 0; ; p->num_frames++) {
+		snprintf(path, sizeof(path), "%s/frame%03u.bin", p->dir,
+			 p->num_frames);
+		if (access(path, R_OK))
+			break;
+	}
+
+	if (!p->num_frames) {
+		printf("no frames to play back in %s\n", p->dir);
+		p->dir = NULL;
+		return -ENOENT;
+	}
+
+	ikvm->backend = &opaque_backend;
+	ikvm->video_fresh = true;
+
+	printf("playing back %u frames from %s\n", p->num_frames, p->dir);
+
+	return 0;
+}
+
+static int init_videodev(struct obmc_ikvm *ikvm)
+{
+	int rc;
+	struct v4l2_capability cap;
+        struct v4l2_format fmt;
+	struct v4l2_streamparm sparm;
+
+	if (!strncmp(ikvm->videodev_name, PLAYBACK_PREFIX,
+		     strlen(PLAYBACK_PREFIX)))
+		return init_playback(ikvm);
+
+	ikvm->videodev_fd = open(ikvm->videodev_name, O_RDWR);
+	if (ikvm->videodev_fd < 0) {
+		/* VGA may have gone to sleep? Try and wake it up */
+		if (ikvm->input_name) {
+			int tmp_fd = open_hid(ikvm->input_name);
+
+			if (tmp_fd >= 0) {
+				struct timespec dur;
+				short xx = 0x3FFF;
+				char rpt[PTR_SIZE + 2];
+
+				dur.tv_sec = 0;
+				dur.tv_nsec =
+					ikvm->process_events_time_us * 1000;
+
+				memset(rpt, 0, sizeof(rpt));
+				rpt[0] = 2;
+				memcpy(&rpt[2], &xx, 2);
+
+				rc = write(tmp_fd, rpt, ikvm->ptr_size + 1);
+				if (rc == ikvm->ptr_size + 1) {
+					nanosleep(&dur, NULL);
+
+					memset(&rpt[1], 0, ikvm->ptr_size);
+					write(tmp_fd, rpt, ikvm->ptr_size + 1);
+				}
+
+				close(tmp_fd);
 			}
 		}
 
-		mod = key_to_mod(key);
-		if (mod) {
-			ikvm->report[0] &= ~mod;
-			goto update_send_report;
+		ikvm->videodev_fd = open(ikvm->videodev_name, O_RDWR);
+		if (ikvm->videodev_fd < 0) {
+			printf("failed to open %s: %d %s\n",
+			       ikvm->videodev_name, errno, strerror(errno));
+			return -ENODEV;
 		}
+	}
+
+	rc = ioctl(ikvm->videodev_fd, VIDIOC_QUERYCAP, &cap);
+	if (rc < 0) {
+		printf("failed to query capabilities: %d %s\n", errno,
+		       strerror(errno));
+		rc = -EINVAL;
+		goto err;
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) ||
+	    !(cap.capabilities & V4L2_CAP_READWRITE)) {
+		printf("device doesn't support this application\n");
+		rc = -EOPNOTSUPP;
+		goto err;
+	}
+
+	/* The Nuvoton ECE hands out a list of hextile rects */
+	if (strstr((char *)cap.driver, "npcm"))
+		ikvm->backend = &rects_backend;
+	else
+		ikvm->backend = &opaque_backend;
+
+	ikvm->video_fresh = true;
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
+	if (rc < 0) {
+		printf("failed to query format: %d %s\n", errno,
+		       strerror(errno));
+		rc = -EINVAL;
+		goto err;
+	}
+
+	set_frame_rate(ikvm);
+
+	if (ikvm->refine.static_ms)
+		init_refine(ikvm, ikvm->motion_quality);
+
+	/*
+	 * The framebuffer is switched over to the video resolution by
+	 * get_frame(); only the capture buffer is needed here.
+	 */
+	rc = alloc_frame(ikvm, fmt_frame_size(&fmt));
+	if (rc)
+		goto err;
+
+	printf("%s ready at %ux%u with %s backend\n", ikvm->videodev_name,
+	       fmt.fmt.pix.width, fmt.fmt.pix.height, ikvm->backend->name);
+
+	return 0;
+
+err:
+	close(ikvm->videodev_fd);
+	ikvm->videodev_fd = -1;
+
+	return rc;
+}
+
+struct keymap_entry {
+	rfbKeySym keysym;
+	unsigned char usage;
+	bool shift;
+};
+
+/*
+ * Every keysym a US keyboard can produce, sorted by keysym. Symbols that
+ * need shift there are flagged so that they come out right even from
+ * clients, like most automation, that don't press shift for them. Only the
+ * US layout is covered: no Latin-1 beyond ASCII and no dead keys; clients
+ * on other layouts should send QEMU extended key events instead.
+ */
+static const struct keymap_entry keymap[] = {
+	{ XK_space, USBHID_KEY_SPACE, false },
+	{ XK_exclam, USBHID_KEY_1, true },
+	{ XK_quotedbl, USBHID_KEY_APOSTROPHE, true },
+	{ XK_numbersign, USBHID_KEY_3, true },
+	{ XK_dollar, USBHID_KEY_4, true },
+	{ XK_percent, USBHID_KEY_5, true },
+	{ XK_ampersand, USBHID_KEY_7, true },
+	{ XK_apostrophe, USBHID_KEY_APOSTROPHE, false },
+	{ XK_parenleft, USBHID_KEY_9, true },
+	{ XK_parenright, USBHID_KEY_0, true },
+	{ XK_asterisk, USBHID_KEY_8, true },
+	{ XK_plus, USBHID_KEY_EQUAL, true },
+	{ XK_comma, USBHID_KEY_COMMA, false },
+	{ XK_minus, USBHID_KEY_MINUS, false },
+	{ XK_period, USBHID_KEY_DOT, false },
+	{ XK_slash, USBHID_KEY_SLASH, false },
+	{ XK_0, USBHID_KEY_0, false },
+	{ XK_1, USBHID_KEY_1, false },
+	{ XK_2, USBHID_KEY_2, false },
+	{ XK_3, USBHID_KEY_3, false },
+	{ XK_4, USBHID_KEY_4, false },
+	{ XK_5, USBHID_KEY_5, false },
+	{ XK_6, USBHID_KEY_6, false },
+	{ XK_7, USBHID_KEY_7, false },
+	{ XK_8, USBHID_KEY_8, false },
+	{ XK_9, USBHID_KEY_9, false },
+	{ XK_colon, USBHID_KEY_SEMICOLON, true },
+	{ XK_semicolon, USBHID_KEY_SEMICOLON, false },
+	{ XK_less, USBHID_KEY_COMMA, true },
+	{ XK_equal, USBHID_KEY_EQUAL, false },
+	{ XK_greater, USBHID_KEY_DOT, true },
+	{ XK_question, USBHID_KEY_SLASH, true },
+	{ XK_at, USBHID_KEY_2, true },
+	{ XK_A, USBHID_KEY_A, false },
+	{ XK_B, USBHID_KEY_B, false },
+	{ XK_C, USBHID_KEY_C, false },
+	{ XK_D, USBHID_KEY_D, false },
+	{ XK_E, USBHID_KEY_E, false },
+	{ XK_F, USBHID_KEY_F, false },
+	{ XK_G, USBHID_KEY_G, false },
+	{ XK_H, USBHID_KEY_H, false },
+	{ XK_I, USBHID_KEY_I, false },
+	{ XK_J, USBHID_KEY_J, false },
+	{ XK_K, USBHID_KEY_K, false },
+	{ XK_L, USBHID_KEY_L, false },
+	{ XK_M, USBHID_KEY_M, false },
+	{ XK_N, USBHID_KEY_N, false },
+	{ XK_O, USBHID_KEY_O, false },
+	{ XK_P, USBHID_KEY_P, false },
+	{ XK_Q, USBHID_KEY_Q, false },
+	{ XK_R, USBHID_KEY_R, false },
+	{ XK_S, USBHID_KEY_S, false },
+	{ XK_T, USBHID_KEY_T, false },
+	{ XK_U, USBHID_KEY_U, false },
+	{ XK_V, USBHID_KEY_V, false },
+	{ XK_W, USBHID_KEY_W, false },
+	{ XK_X, USBHID_KEY_X, false },
+	{ XK_Y, USBHID_KEY_Y, false },
+	{ XK_Z, USBHID_KEY_Z, false },
+	{ XK_bracketleft, USBHID_KEY_LEFTBRACE, false },
+	{ XK_backslash, USBHID_KEY_BACKSLASH, false },
+	{ XK_bracketright, USBHID_KEY_RIGHTBRACE, false },
+	{ XK_asciicircum, USBHID_KEY_6, true },
+	{ XK_underscore, USBHID_KEY_MINUS, true },
+	{ XK_grave, USBHID_KEY_GRAVE, false },
+	{ XK_a, USBHID_KEY_A, false },
+	{ XK_b, USBHID_KEY_B, false },
+	{ XK_c, USBHID_KEY_C, false },
+	{ XK_d, USBHID_KEY_D, false },
+	{ XK_e, USBHID_KEY_E, false },
+	{ XK_f, USBHID_KEY_F, false },
+	{ XK_g, USBHID_KEY_G, false },
+	{ XK_h, USBHID_KEY_H, false },
+	{ XK_i, USBHID_KEY_I, false },
+	{ XK_j, USBHID_KEY_J, false },
+	{ XK_k, USBHID_KEY_K, false },
+	{ XK_l, USBHID_KEY_L, false },
+	{ XK_m, USBHID_KEY_M, false },
+	{ XK_n, USBHID_KEY_N, false },
+	{ XK_o, USBHID_KEY_O, false },
+	{ XK_p, USBHID_KEY_P, false },
+	{ XK_q, USBHID_KEY_Q, false },
+	{ XK_r, USBHID_KEY_R, false },
+	{ XK_s, USBHID_KEY_S, false },
+	{ XK_t, USBHID_KEY_T, false },
+	{ XK_u, USBHID_KEY_U, false },
+	{ XK_v, USBHID_KEY_V, false },
+	{ XK_w, USBHID_KEY_W, false },
+	{ XK_x, USBHID_KEY_X, false },
+	{ XK_y, USBHID_KEY_Y, false },
+	{ XK_z, USBHID_KEY_Z, false },
+	{ XK_braceleft, USBHID_KEY_LEFTBRACE, true },
+	{ XK_bar, USBHID_KEY_BACKSLASH, true },
+	{ XK_braceright, USBHID_KEY_RIGHTBRACE, true },
+	{ XK_asciitilde, USBHID_KEY_GRAVE, true },
+	{ XK_yen, USBHID_KEY_YEN, false },
+	{ XK_ISO_Level3_Shift, USBHID_KEY_RIGHTALT, false },
+	{ XK_BackSpace, USBHID_KEY_BACKSPACE, false },
+	{ XK_Tab, USBHID_KEY_TAB, false },
+	{ XK_Return, USBHID_KEY_RETURN, false },
+	{ XK_Pause, USBHID_KEY_PAUSE, false },
+	{ XK_Scroll_Lock, USBHID_KEY_SCROLLLOCK, false },
+	{ XK_Sys_Req, USBHID_KEY_SYSRQ, false },
+	{ XK_Escape, USBHID_KEY_ESC, false },
+	{ XK_Muhenkan, USBHID_KEY_MUHENKAN, false },
+	{ XK_Henkan, USBHID_KEY_HENKAN, false },
+	{ XK_Hiragana_Katakana, USBHID_KEY_KATAKANAHIRAGANA, false },
+	{ KEYSYM_HANGUL, USBHID_KEY_HANGEUL, false },
+	{ KEYSYM_HANGUL_HANJA, USBHID_KEY_HANJA, false },
+	{ XK_Home, USBHID_KEY_HOME, false },
+	{ XK_Left, USBHID_KEY_LEFT, false },
+	{ XK_Up, USBHID_KEY_UP, false },
+	{ XK_Right, USBHID_KEY_RIGHT, false },
+	{ XK_Down, USBHID_KEY_DOWN, false },
+	{ XK_Page_Up, USBHID_KEY_PAGEUP, false },
+	{ XK_Page_Down, USBHID_KEY_PAGEDOWN, false },
+	{ XK_End, USBHID_KEY_END, false },
+	{ XK_Print, USBHID_KEY_PRINT, false },
+	{ XK_Insert, USBHID_KEY_INSERT, false },
+	{ XK_Menu, USBHID_KEY_COMPOSE, false },
+	{ XK_Help, USBHID_KEY_HELP, false },
+	{ XK_Break, USBHID_KEY_PAUSE, false },
+	{ XK_Num_Lock, USBHID_KEY_NUMLOCK, false },
+	{ XK_KP_Enter, USBHID_KEY_KPENTER, false },
+	{ XK_KP_Home, USBHID_KEY_KP7, false },
+	{ XK_KP_Left, USBHID_KEY_KP4, false },
+	{ XK_KP_Up, USBHID_KEY_KP8, false },
+	{ XK_KP_Right, USBHID_KEY_KP6, false },
+	{ XK_KP_Down, USBHID_KEY_KP2, false },
+	{ XK_KP_Page_Up, USBHID_KEY_KP9, false },
+	{ XK_KP_Page_Down, USBHID_KEY_KP3, false },
+	{ XK_KP_End, USBHID_KEY_KP1, false },
+	{ XK_KP_Begin, USBHID_KEY_KP5, false },
+	{ XK_KP_Insert, USBHID_KEY_KP0, false },
+	{ XK_KP_Delete, USBHID_KEY_KPDOT, false },
+	{ XK_KP_Multiply, USBHID_KEY_KPASTERISK, false },
+	{ XK_KP_Add, USBHID_KEY_KPPLUS, false },
+	{ XK_KP_Separator, USBHID_KEY_KPCOMMA, false },
+	{ XK_KP_Subtract, USBHID_KEY_KPMINUS, false },
+	{ XK_KP_Decimal, USBHID_KEY_KPDOT, false },
+	{ XK_KP_Divide, USBHID_KEY_KPSLASH, false },
+	{ XK_KP_0, USBHID_KEY_KP0, false },
+	{ XK_KP_1, USBHID_KEY_KP1, false },
+	{ XK_KP_2, USBHID_KEY_KP2, false },
+	{ XK_KP_3, USBHID_KEY_KP3, false },
+	{ XK_KP_4, USBHID_KEY_KP4, false },
+	{ XK_KP_5, USBHID_KEY_KP5, false },
+	{ XK_KP_6, USBHID_KEY_KP6, false },
+	{ XK_KP_7, USBHID_KEY_KP7, false },
+	{ XK_KP_8, USBHID_KEY_KP8, false },
+	{ XK_KP_9, USBHID_KEY_KP9, false },
+	{ XK_KP_Equal, USBHID_KEY_KPEQUAL, false },
+	{ XK_F1, USBHID_KEY_F1, false },
+	{ XK_F2, USBHID_KEY_F2, false },
+	{ XK_F3, USBHID_KEY_F3, false },
+	{ XK_F4, USBHID_KEY_F4, false },
+	{ XK_F5, USBHID_KEY_F5, false },
+	{ XK_F6, USBHID_KEY_F6, false },
+	{ XK_F7, USBHID_KEY_F7, false },
+	{ XK_F8, USBHID_KEY_F8, false },
+	{ XK_F9, USBHID_KEY_F9, false },
+	{ XK_F10, USBHID_KEY_F10, false },
+	{ XK_F11, USBHID_KEY_F11, false },
+	{ XK_F12, USBHID_KEY_F12, false },
+	{ XK_F13, USBHID_KEY_F13, false },
+	{ XK_F14, USBHID_KEY_F14, false },
+	{ XK_F15, USBHID_KEY_F15, false },
+	{ XK_F16, USBHID_KEY_F16, false },
+	{ XK_F17, USBHID_KEY_F17, false },
+	{ XK_F18, USBHID_KEY_F18, false },
+	{ XK_F19, USBHID_KEY_F19, false },
+	{ XK_F20, USBHID_KEY_F20, false },
+	{ XK_F21, USBHID_KEY_F21, false },
+	{ XK_F22, USBHID_KEY_F22, false },
+	{ XK_F23, USBHID_KEY_F23, false },
+	{ XK_F24, USBHID_KEY_F24, false },
+	{ XK_Shift_L, USBHID_KEY_LEFTSHIFT, false },
+	{ XK_Shift_R, USBHID_KEY_RIGHTSHIFT, false },
+	{ XK_Control_L, USBHID_KEY_LEFTCTRL, false },
+	{ XK_Control_R, USBHID_KEY_RIGHTCTRL, false },
+	{ XK_Caps_Lock, USBHID_KEY_CAPSLOCK, false },
+	{ XK_Meta_L, USBHID_KEY_LEFTMETA, false },
+	{ XK_Meta_R, USBHID_KEY_RIGHTMETA, false },
+	{ XK_Alt_L, USBHID_KEY_LEFTALT, false },
+	{ XK_Alt_R, USBHID_KEY_RIGHTALT, false },
+	{ XK_Super_L, USBHID_KEY_LEFTMETA, false },
+	{ XK_Super_R, USBHID_KEY_RIGHTMETA, false },
+	{ XK_Delete, USBHID_KEY_DELETE, false },
+	{ KEYSYM_AUDIO_LOWER, USBHID_KEY_VOLUMEDOWN, false },
+	{ KEYSYM_AUDIO_MUTE, USBHID_KEY_MUTE, false },
+	{ KEYSYM_AUDIO_RAISE, USBHID_KEY_VOLUMEUP, false },
+	{ KEYSYM_POWER_OFF, USBHID_KEY_POWER, false },
+};
+
+/*
+ * XT scancodes as QEMU Extended Key Events carry them, with 0xe0-prefixed
+ * codes folded into the upper half, to USB HID usages.
+ */
+static const unsigned char xt_to_usage[256] = {
+	[0x01] = USBHID_KEY_ESC,
+	[0x02] = USBHID_KEY_1,
+	[0x03] = USBHID_KEY_2,
+	[0x04] = USBHID_KEY_3,
+	[0x05] = USBHID_KEY_4,
+	[0x06] = USBHID_KEY_5,
+	[0x07] = USBHID_KEY_6,
+	[0x08] = USBHID_KEY_7,
+	[0x09] = USBHID_KEY_8,
+	[0x0a] = USBHID_KEY_9,
+	[0x0b] = USBHID_KEY_0,
+	[0x0c] = USBHID_KEY_MINUS,
+	[0x0d] = USBHID_KEY_EQUAL,
+	[0x0e] = USBHID_KEY_BACKSPACE,
+	[0x0f] = USBHID_KEY_TAB,
+	[0x10] = USBHID_KEY_Q,
+	[0x11] = USBHID_KEY_W,
+	[0x12] = USBHID_KEY_E,
+	[0x13] = USBHID_KEY_R,
+	[0x14] = USBHID_KEY_T,
+	[0x15] = USBHID_KEY_Y,
+	[0x16] = USBHID_KEY_U,
+	[0x17] = USBHID_KEY_I,
+	[0x18] = USBHID_KEY_O,
+	[0x19] = USBHID_KEY_P,
+	[0x1a] = USBHID_KEY_LEFTBRACE,
+	[0x1b] = USBHID_KEY_RIGHTBRACE,
+	[0x1c] = USBHID_KEY_RETURN,
+	[0x1d] = USBHID_KEY_LEFTCTRL,
+	[0x1e] = USBHID_KEY_A,
+	[0x1f] = USBHID_KEY_S,
+	[0x20] = USBHID_KEY_D,
+	[0x21] = USBHID_KEY_F,
+	[0x22] = USBHID_KEY_G,
+	[0x23] = USBHID_KEY_H,
+	[0x24] = USBHID_KEY_J,
+	[0x25] = USBHID_KEY_K,
+	[0x26] = USBHID_KEY_L,
+	[0x27] = USBHID_KEY_SEMICOLON,
+	[0x28] = USBHID_KEY_APOSTROPHE,
+	[0x29] = USBHID_KEY_GRAVE,
+	[0x2a] = USBHID_KEY_LEFTSHIFT,
+	[0x2b] = USBHID_KEY_BACKSLASH,
+	[0x2c] = USBHID_KEY_Z,
+	[0x2d] = USBHID_KEY_X,
+	[0x2e] = USBHID_KEY_C,
+	[0x2f] = USBHID_KEY_V,
+	[0x30] = USBHID_KEY_B,
+	[0x31] = USBHID_KEY_N,
+	[0x32] = USBHID_KEY_M,
+	[0x33] = USBHID_KEY_COMMA,
+	[0x34] = USBHID_KEY_DOT,
+	[0x35] = USBHID_KEY_SLASH,
+	[0x36] = USBHID_KEY_RIGHTSHIFT,
+	[0x37] = USBHID_KEY_KPASTERISK,
+	[0x38] = USBHID_KEY_LEFTALT,
+	[0x39] = USBHID_KEY_SPACE,
+	[0x3a] = USBHID_KEY_CAPSLOCK,
+	[0x3b] = USBHID_KEY_F1,
+	[0x3c] = USBHID_KEY_F2,
+	[0x3d] = USBHID_KEY_F3,
+	[0x3e] = USBHID_KEY_F4,
+	[0x3f] = USBHID_KEY_F5,
+	[0x40] = USBHID_KEY_F6,
+	[0x41] = USBHID_KEY_F7,
+	[0x42] = USBHID_KEY_F8,
+	[0x43] = USBHID_KEY_F9,
+	[0x44] = USBHID_KEY_F10,
+	[0x45] = USBHID_KEY_NUMLOCK,
+	[0x46] = USBHID_KEY_SCROLLLOCK,
+	[0x47] = USBHID_KEY_KP7,
+	[0x48] = USBHID_KEY_KP8,
+	[0x49] = USBHID_KEY_KP9,
+	[0x4a] = USBHID_KEY_KPMINUS,
+	[0x4b] = USBHID_KEY_KP4,
+	[0x4c] = USBHID_KEY_KP5,
+	[0x4d] = USBHID_KEY_KP6,
+	[0x4e] = USBHID_KEY_KPPLUS,
+	[0x4f] = USBHID_KEY_KP1,
+	[0x50] = USBHID_KEY_KP2,
+	[0x51] = USBHID_KEY_KP3,
+	[0x52] = USBHID_KEY_KP0,
+	[0x53] = USBHID_KEY_KPDOT,
+	[0x54] = USBHID_KEY_SYSRQ,
+	[0x56] = USBHID_KEY_102ND,
+	[0x57] = USBHID_KEY_F11,
+	[0x58] = USBHID_KEY_F12,
+	[0x59] = USBHID_KEY_KPEQUAL,
+	[0x5d] = USBHID_KEY_F13,
+	[0x5e] = USBHID_KEY_F14,
+	[0x5f] = USBHID_KEY_F15,
+	[0x64] = USBHID_KEY_F13,
+	[0x65] = USBHID_KEY_F14,
+	[0x66] = USBHID_KEY_F15,
+	[0x67] = USBHID_KEY_F16,
+	[0x68] = USBHID_KEY_F17,
+	[0x69] = USBHID_KEY_F18,
+	[0x6a] = USBHID_KEY_F19,
+	[0x6b] = USBHID_KEY_F20,
+	[0x6c] = USBHID_KEY_F21,
+	[0x6d] = USBHID_KEY_F22,
+	[0x6e] = USBHID_KEY_F23,
+	[0x70] = USBHID_KEY_KATAKANAHIRAGANA,
+	[0x73] = USBHID_KEY_RO,
+	[0x76] = USBHID_KEY_F24,
+	[0x79] = USBHID_KEY_HENKAN,
+	[0x7b] = USBHID_KEY_MUHENKAN,
+	[0x7d] = USBHID_KEY_YEN,
+	[0x7e] = USBHID_KEY_KPCOMMA,
+	[0x9c] = USBHID_KEY_KPENTER,
+	[0x9d] = USBHID_KEY_RIGHTCTRL,
+	[0xa0] = USBHID_KEY_MUTE,
+	[0xae] = USBHID_KEY_VOLUMEDOWN,
+	[0xb0] = USBHID_KEY_VOLUMEUP,
+	[0xb5] = USBHID_KEY_KPSLASH,
+	[0xb7] = USBHID_KEY_PRINT,
+	[0xb8] = USBHID_KEY_RIGHTALT,
+	[0xc6] = USBHID_KEY_PAUSE,
+	[0xc7] = USBHID_KEY_HOME,
+	[0xc8] = USBHID_KEY_UP,
+	[0xc9] = USBHID_KEY_PAGEUP,
+	[0xcb] = USBHID_KEY_LEFT,
+	[0xcd] = USBHID_KEY_RIGHT,
+	[0xcf] = USBHID_KEY_END,
+	[0xd0] = USBHID_KEY_DOWN,
+	[0xd1] = USBHID_KEY_PAGEDOWN,
+	[0xd2] = USBHID_KEY_INSERT,
+	[0xd3] = USBHID_KEY_DELETE,
+	[0xdb] = USBHID_KEY_LEFTMETA,
+	[0xdc] = USBHID_KEY_RIGHTMETA,
+	[0xdd] = USBHID_KEY_COMPOSE,
+	[0xde] = USBHID_KEY_POWER,
+	[0xf1] = USBHID_KEY_HANJA,
+	[0xf2] = USBHID_KEY_HANGEUL,
+};
+
+static int cmp_keymap(const void *a, const void *b)
+{
+	rfbKeySym key = *(const rfbKeySym *)a;
+	const struct keymap_entry *e = b;
+
+	return key < e->keysym ? -1 : key > e->keysym;
+}
+
+static const struct keymap_entry *keysym_to_entry(rfbKeySym key)
+{
+	return bsearch(&key, keymap, sizeof(keymap) / sizeof(keymap[0]),
+		       sizeof(keymap[0]), cmp_keymap);
+}
+
+static unsigned char keysym_to_usage(rfbKeySym key)
+{
+	const struct keymap_entry *e = keysym_to_entry(key);
+
+	return e ? e->usage : 0;
+}
+
+static unsigned long long record_time_us(struct obmc_ikvm *ikvm)
+{
+	unsigned long long now = now_ns();
+
+	if (!ikvm->record_start_ns)
+		ikvm->record_start_ns = now;
+
+	return (now - ikvm->record_start_ns) / 1000ULL;
+}
+
+/*
+ * Press or release one usage in the keyboard report. Keys are released by
+ * usage, so it doesn't matter which of the keysyms on a key the client
+ * names when it lets go. A key flagged shift holds shift down with it
+ * unless a real shift key already is.
+ */
+static void usage_event(struct obmc_ikvm *ikvm, bool down,
+			unsigned char usage, bool shift)
+{
+	unsigned int i;
+	unsigned int free_slot = 0;
+
+	if (usage >= USBHID_KEY_LEFTCTRL) {
+		unsigned char mod = 1 << (usage - USBHID_KEY_LEFTCTRL);
+
+		if (down)
+			ikvm->mods |= mod;
+		else
+			ikvm->mods &= ~mod;
+
+		goto update_send_report;
+	}
+
+	for (i = 2; i < ikvm->report_size; ++i) {
+		if (ikvm->report[i] == usage)
+			break;
+
+		if (!ikvm->report[i] && !free_slot)
+			free_slot = i;
+	}
+
+	if (!down) {
+		if (i == ikvm->report_size)
+			return;
+
+		ikvm->report[i] = 0;
+		ikvm->report_shift[i - 2] = false;
+		goto update_send_report;
+	}
+
+	if (i == ikvm->report_size) {
+		if (!free_slot) {
+			DBG("no space in report for additional key press!\n");
+			return;
+		}
+
+		i = free_slot;
+		ikvm->report[i] = usage;
+	}
+
+	ikvm->report_shift[i - 2] = shift;
+
+update_send_report:
+	ikvm->report[0] = ikvm->mods;
+
+	if (!(ikvm->mods & (USBHID_MOD_LEFTSHIFT | USBHID_MOD_RIGHTSHIFT))) {
+		for (i = 0; i < ikvm->report_size - 2; ++i) {
+			if (ikvm->report_shift[i])
+				ikvm->report[0] |= USBHID_MOD_LEFTSHIFT;
+		}
+	}
+
+	ikvm->send_report = true;
+}
+
+static void key_event(rfbBool down, rfbKeySym key, rfbClientPtr cl)
+{
+	struct obmc_ikvm *ikvm = cl->screen->screenData;
+	const struct keymap_entry *e = keysym_to_entry(key);
+
+	DBG("key event %s %x\n", down ? "down" : "up", key);
+
+	if (ikvm->record_file)
+		fprintf(ikvm->record_file, "%llu k %d %u\n",
+			record_time_us(ikvm), down ? 1 : 0, key);
+
+	if (e) {
+		pthread_mutex_lock(&input_mutex);
+		usage_event(ikvm, down, e->usage, e->shift);
+		pthread_mutex_unlock(&input_mutex);
+	}
+}
+
+static rfbBool qemu_key_enable(rfbClientPtr cl, void **data, int encoding)
+{
+	struct ikvm_client *client = cl->clientData;
+	char msg[sz_rfbFramebufferUpdateMsg +
+		 sz_rfbFramebufferUpdateRectHeader];
+	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)msg;
+	rfbFramebufferUpdateRectHeader hdr;
+
+	if (*data)
+		return TRUE;
+
+	/* An empty pseudo-rect tells the client it may send the events */
+	memset(msg, 0, sizeof(msg));
+	memset(&hdr, 0, sizeof(hdr));
+	fu->type = rfbFramebufferUpdate;
+	fu->nRects = Swap16IfLE(1);
+	hdr.encoding = Swap32IfLE(RFB_ENCODING_QEMU_KEY);
+	memcpy(&msg[sz_rfbFramebufferUpdateMsg], &hdr,
+	       sz_rfbFramebufferUpdateRectHeader);
+
+	pthread_mutex_lock(&client->send_lock);
+	rfbWriteExact(cl, msg, sizeof(msg));
+	pthread_mutex_unlock(&client->send_lock);
+
+	*data = client;
+
+	return TRUE;
+}
+
+/*
+ * A QEMU Extended Key Event names the physical key, so it maps straight to
+ * a usage whatever the client's layout; the keysym is only used when the
+ * scancode isn't known.
+ */
+static rfbBool qemu_key_message(rfbClientPtr cl, void *data,
+				const rfbClientToServerMsg *message)
+{
+	int rc;
+	char msg[11];
+	uint16_t down;
+	uint32_t key;
+	uint32_t keycode;
+	unsigned char usage = 0;
+	struct obmc_ikvm *ikvm = cl->screen->screenData;
+
+	if (message->type != RFB_QEMU_MSG)
+		return FALSE;
+
+	rc = rfbReadExact(cl, msg, sizeof(msg));
+	if (rc <= 0) {
+		if (rc)
+			rfbLogPerror("qemu_key_message: read");
+		rfbCloseClient(cl);
+		return TRUE;
+	}
+
+	/* Other QEMU messages have their own lengths; there's no skipping */
+	if (msg[0] != RFB_QEMU_EXT_KEY) {
+		rfbLog("unsupported qemu message %d\n", msg[0]);
+		rfbCloseClient(cl);
+		return TRUE;
+	}
+
+	if (cl->viewOnly)
+		return TRUE;
+
+	memcpy(&down, &msg[1], sizeof(down));
+	memcpy(&key, &msg[3], sizeof(key));
+	memcpy(&keycode, &msg[7], sizeof(keycode));
+	down = Swap16IfLE(down);
+	key = Swap32IfLE(key);
+	keycode = Swap32IfLE(keycode);
+
+	if (keycode < sizeof(xt_to_usage))
+		usage = xt_to_usage[keycode];
+
+	if (!usage) {
+		if (cl->screen->kbdAddEvent)
+			cl->screen->kbdAddEvent(down, key, cl);
+		return TRUE;
+	}
+
+	DBG("ext key event %s %x %x\n", down ? "down" : "up", keycode, key);
+
+	if (ikvm->record_file)
+		fprintf(ikvm->record_file, "%llu k %d %u\n",
+			record_time_us(ikvm), down ? 1 : 0, key);
+
+	pthread_mutex_lock(&input_mutex);
+	usage_event(ikvm, down, usage, false);
+	pthread_mutex_unlock(&input_mutex);
+
+	return TRUE;
+}
+
+static int qemu_key_encodings[] = {
+	RFB_ENCODING_QEMU_KEY,
+	0
+};
+
+static rfbProtocolExtension qemu_key_extension = {
+	.pseudoEncodings = qemu_key_encodings,
+	.enablePseudoEncoding = qemu_key_enable,
+	.handleMessage = qemu_key_message,
+};
+
+static void init_keyboard(struct obmc_ikvm *ikvm)
+{
+	ikvm->keyboard_fd = open_hid(ikvm->keyboard_name);
+	if (ikvm->keyboard_fd < 0) {
+		printf("failed to open %s: %d %s\n", ikvm->keyboard_name,
+		       errno, strerror(errno));
+		return;
+	}
+
+	ikvm->server->kbdAddEvent = key_event;
+}
+
+/* Called by the rfb thread for every report that reached the gadget */
+static void report_written(struct obmc_ikvm *ikvm)
+{
+	__atomic_add_fetch(&ikvm->reports, 1, __ATOMIC_RELEASE);
+
+	if (ikvm->latency.probes && !ikvm->latency.report_ns)
+		__atomic_store_n(&ikvm->latency.report_ns, now_ns(),
+				 __ATOMIC_RELEASE);
+}
+
+static void keyboard_send_report(struct obmc_ikvm *ikvm)
+{
+	pthread_mutex_lock(&input_mutex);
+
+	if (ikvm->send_report) {
+		int fd;
+		char rpt[REPORT_SIZE];
+		unsigned char *data;
+
+		if (ikvm->input_fd >= 0) {
+			fd = ikvm->input_fd;
+
+			rpt[0] = 1;
+			memcpy(&rpt[1], ikvm->report, ikvm->report_size);
+
+			data = rpt;
+		} else {
+			fd = ikvm->keyboard_fd;
+
+			data = ikvm->report;
+		}
+
+		DBG("sending kbd report[%02x%02x%02x%02x%02x%02x%02x%02x]\n",
+		    data[0], data[1], data[2], data[3], data[4], data[5],
+		    data[6], data[7]);
+		if (write(fd, data, REPORT_SIZE) != REPORT_SIZE)
+			printf("failed to write keyboard report: %d %s\n",
+			       errno, strerror(errno));
+		else
+			report_written(ikvm);
+
+		ikvm->send_report = false;
+	}
+
+	pthread_mutex_unlock(&input_mutex);
+}
+
+/* Map 0 to size - 1 onto the gadget's whole logical range, rounding */
+static short ptr_scale(int v, size_t size)
+{
+	if (size < 2)
+		return 0;
+
+	return (((unsigned long long)v * PTR_MAX) + ((size - 1) / 2)) /
+		(size - 1);
+}
+
+static void ptr_write_report(struct obmc_ikvm *ikvm)
+{
+	int fd;
+	char rpt[PTR_SIZE + 2];
+	size_t rs;
+	unsigned char *data;
+
+	if (ikvm->input_fd >= 0) {
+		fd = ikvm->input_fd;
+		rs = ikvm->ptr_size + 1;
+
+		rpt[0] = 2;
+		memcpy(&rpt[1], ikvm->ptr, ikvm->ptr_size);
+
+		data = rpt;
+
+		DBG("sending ptr report[%02x%02x%02x%02x%02x%02x]\n",
+		    data[0], data[1], data[2], data[3], data[4], data[5]);
+	} else {
+		fd = ikvm->ptr_fd;
+		rs = ikvm->ptr_size;
+
+		data = ikvm->ptr;
+
+		DBG("sending ptr report[%02x%02x%02x%02x%02x]\n",
+		    data[0], data[1], data[2], data[3], data[4]);
+	}
+
+	if (write(fd, data, rs) != rs) {
+		printf("failed to write ptr report: %d %s\n", errno,
+		       strerror(errno));
+	} else {
+		ikvm->ptr_reports++;
+		report_written(ikvm);
+	}
+
+	/* Wheel movement is relative; it's been told */
+	if (ikvm->ptr_size > PTR_SIZE)
+		ikvm->ptr[PTR_SIZE] = 0;
+
+	ikvm->ptr_sent_ns = now_ns();
+	ikvm->send_ptr = false;
+}
+
+/*
+ * Motion is coalesced into the next report, but a press or release must
+ * not be merged away, so the report pending before one goes out first.
+ * With a wheel in the report, the client's wheel buttons turn into steps.
+ */
+static void ptr_event(int button_mask, int x, int y, rfbClientPtr cl)
+{
+	struct obmc_ikvm *ikvm = cl->screen->screenData;
+	bool wheel = ikvm->ptr_size > PTR_SIZE;
+	int pressed = button_mask & ~ikvm->ptr_mask;
+	unsigned char buttons = button_mask & (wheel ? PTR_BUTTONS : 0xFF);
+
+	DBG("ptr event btn[%x] x[%d] y[%d]\n", button_mask, x, y);
+
+	if (ikvm->record_file)
+		fprintf(ikvm->record_file, "%llu p %d %d %d\n",
+			record_time_us(ikvm), button_mask, x, y);
+
+	if (ikvm->send_ptr && buttons != (unsigned char)ikvm->ptr[0])
+		ptr_write_report(ikvm);
+
+	ikvm->ptr_mask = button_mask;
+	ikvm->ptr[0] = buttons;
+
+	if (wheel) {
+		signed char *steps = (signed char *)&ikvm->ptr[PTR_SIZE];
+
+		if ((pressed & PTR_WHEEL_UP) && *steps < 127)
+			(*steps)++;
+
+		if ((pressed & PTR_WHEEL_DOWN) && *steps > -127)
+			(*steps)--;
+	}
+
+	if (x >= 0 && x < ikvm->resolution.width) {
+		short xx = ptr_scale(x, ikvm->resolution.width);
+
+		memcpy(&ikvm->ptr[1], &xx, 2);
+	}
+
+	if (y >= 0 && y < ikvm->resolution.height) {
+		short yy = ptr_scale(y, ikvm->resolution.height);
+
+		memcpy(&ikvm->ptr[3], &yy, 2);
+	}
+
+	ikvm->send_ptr = true;
+
+	rfbDefaultPtrAddEvent(button_mask, x, y, cl);
+}
+
+static void init_ptr(struct obmc_ikvm *ikvm)
+{
+	ikvm->ptr_fd = open_hid(ikvm->ptr_name);
+	if (ikvm->ptr_fd < 0) {
+		printf("failed to open %s: %d %s\n", ikvm->ptr_name, errno,
+		       strerror(errno));
+		return;
+	}
+
+	ikvm->server->ptrAddEvent = ptr_event;
+}
+
+static unsigned long long ptr_due_ns(struct obmc_ikvm *ikvm)
+{
+	return ikvm->ptr_sent_ns + ikvm->ptr_interval_ns;
+}
+
+/* No more than one report per interval of the gadget's endpoint */
+static void ptr_send_report(struct obmc_ikvm *ikvm)
+{
+	if (ikvm->send_ptr && now_ns() >= ptr_due_ns(ikvm))
+		ptr_write_report(ikvm);
+}
+
+/* Wait for client events no longer than until a held report is due */
+static long ptr_wait_us(struct obmc_ikvm *ikvm)
+{
+	unsigned long long now;
+	unsigned long long due;
+
+	if (!ikvm->send_ptr ||
+	    (!ikvm->server->clientHead && !ikvm->latency.cl))
+		return ikvm->process_events_time_us;
+
+	now = now_ns();
+	due = ptr_due_ns(ikvm);
+	if (due <= now)
+		return 0;
+
+	if ((due - now) / 1000 < ikvm->process_events_time_us)
+		return (due - now) / 1000;
+
+	return ikvm->process_events_time_us;
+}
+
+static void init_input(struct obmc_ikvm *ikvm)
+{
+	ikvm->input_fd = open_hid(ikvm->input_name);
+	if (ikvm->input_fd < 0) {
+		printf("failed to open %s: %d %s\n", ikvm->input_name, errno,
+		       strerror(errno));
+		return;
+	}
+
+	ikvm->server->kbdAddEvent = key_event;
+	ikvm->server->ptrAddEvent = ptr_event;
+	ikvm->report_size = REPORT_SIZE - 1;
+}
+
+static int client_queued(rfbClientPtr cl)
+{
+	int queued;
+
+	if (cl->sock < 0 || ioctl(cl->sock, SIOCOUTQ, &queued) < 0)
+		return 0;
+
+	return queued;
+}
+
+static void print_client(rfbClientPtr cl)
+{
+	struct ikvm_client *client = cl->clientData;
+	struct client_stats *stats = &client->stats;
+
+	printf("client %s%s: frames %llu bytes %llu cpu %llu us queued %d "
+	       "max %d backlogs %llu\n", cl->host,
+	       client->spectator ? " (spectator)" : "", stats->frames,
+	       stats->bytes, stats->cpu_ns / 1000, client_queued(cl),
+	       stats->queued_max, stats->backlogs);
+}
+
+/*
+ * libvncserver links a client in before new_client() gives it its state,
+ * and a refused one has none until it's gone; other threads skip those.
+ */
+/*
+ * libvncserver frees a client right after client_gone(), and only waits for
+ * other threads' iterators to let go of it with its own background loop, so
+ * the capture thread's walks keep client_gone() out until they're done.
+ */
+static rfbClientIteratorPtr walk_clients(struct obmc_ikvm *ikvm)
+{
+	pthread_mutex_lock(&clients_mutex);
+
+	return rfbGetClientIterator(ikvm->server);
+}
+
+static void end_walk(rfbClientIteratorPtr iterator)
+{
+	rfbReleaseClientIterator(iterator);
+	pthread_mutex_unlock(&clients_mutex);
+}
+
+static rfbClientPtr next_client(rfbClientIteratorPtr iterator)
+{
+	rfbClientPtr cl;
+
+	while ((cl = rfbClientIteratorNext(iterator)) &&
+	       !__atomic_load_n(&cl->clientData, __ATOMIC_ACQUIRE))
+		;
+
+	return cl;
+}
+
+static void print_clients(struct obmc_ikvm *ikvm)
+{
+	rfbClientIteratorPtr iterator = walk_clients(ikvm);
+	rfbClientPtr cl;
+
+	printf("clients %d (limit %d) spectators %d (limit %d)\n",
+	       ikvm->num_clients - ikvm->num_spectators, ikvm->max_clients,
+	       ikvm->num_spectators, ikvm->max_spectators);
+
+	while ((cl = next_client(iterator)))
+		print_client(cl);
+
+	end_walk(iterator);
+}
+
+static void client_gone(rfbClientPtr cl)
+{
+	struct ikvm_client *client = cl->clientData;
+	struct obmc_ikvm *ikvm = client->ikvm;
+
+	print_client(cl);
+
+	if (client->spectator)
+		ikvm->num_spectators--;
+
+	/* Wait for the capture thread to be done with it */
+	pthread_mutex_lock(&clients_mutex);
+	__atomic_store_n(&cl->clientData, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&clients_mutex);
+
+	pthread_mutex_destroy(&client->send_lock);
+	free(client);
+
+	if (cl == ikvm->relay.cl) {
+		printf("relay connection to %s lost\n", ikvm->relay.host);
+		ikvm->relay.cl = NULL;
+		ikvm->relay.retry_ns = now_ns() +
+			ikvm->relay.retry_ms * 1000000ULL;
+	}
+
+	if (ikvm->num_clients-- > 1)
+		return;
+
+	/* Have the capture thread re-open the device for the next client */
+	ikvm->reset_video = true;
+}
+
+/* Called with the client's send lock held */
+static rfbBool send_fence(rfbClientPtr cl, uint32_t flags, uint8_t len,
+			  const void *payload)
+{
+	char msg[9 + RFB_FENCE_MAX_PAYLOAD];
+
+	flags = Swap32IfLE(flags);
+
+	memset(msg, 0, 4);
+	msg[0] = RFB_FENCE;
+	memcpy(&msg[4], &flags, 4);
+	msg[8] = len;
+	if (len)
+		memcpy(&msg[9], payload, len);
+
+	return rfbWriteExact(cl, msg, 9 + len) > 0;
+}
+
+/* Ask the client to tell us when it got through everything sent so far */
+static void flow_sent(rfbClientPtr cl, size_t len)
+{
+	struct ikvm_client *client = cl->clientData;
+	struct flow_fence ping;
+
+	client->flow.sent_bytes += len;
+	if (!client->flow.fence)
+		return;
+
+	ping.sent_ns = now_ns();
+	ping.sent_bytes = client->flow.sent_bytes;
+	send_fence(cl, RFB_FENCE_REQUEST | RFB_FENCE_BLOCK_BEFORE,
+		   sizeof(ping), &ping);
+}
+
+/*
+ * Halve the window when data takes longer than the latency bound to get
+ * through and grow it while it is what holds updates back.
+ */
+static void flow_acked(rfbClientPtr cl, const struct flow_fence *ping)
+{
+	struct ikvm_client *client = cl->clientData;
+	struct flow *flow = &client->flow;
+
+	flow->rtt_ns = now_ns() - ping->sent_ns;
+	if (ping->sent_bytes > flow->acked_bytes)
+		flow->acked_bytes = ping->sent_bytes;
+
+	if (flow->rtt_ns > client->ikvm->max_latency_ns) {
+		flow->window /= 2;
+		if (flow->window < FLOW_WINDOW_MIN)
+			flow->window = FLOW_WINDOW_MIN;
+	} else if (flow->window_full) {
+		flow->window += flow->window / 2;
+		if (flow->window > FLOW_WINDOW_MAX)
+			flow->window = FLOW_WINDOW_MAX;
+	}
+
+	flow->window_full = false;
+}
+
+/*
+ * Hold updates back from a client with more than the limit sitting in its
+ * socket, whatever it says about flow control, and drop it when that lasts.
+ * Called with the client's send lock held.
+ */
+static bool client_backlogged(rfbClientPtr cl, struct ikvm_client *client)
+{
+	int queued = client_queued(cl);
+	unsigned long long now;
+	struct client_stats *stats = &client->stats;
+
+	if (queued > stats->queued_max)
+		stats->queued_max = queued;
+
+	if (queued <= client->ikvm->max_queued) {
+		stats->backlog_ns = 0;
+		return false;
+	}
+
+	now = now_ns();
+	if (!stats->backlog_ns) {
+		stats->backlog_ns = now;
+		stats->backlogs++;
+	} else if (now - stats->backlog_ns >
+		   CLIENT_STALL_MS * 1000000ULL) {
+		printf("dropping client %s: %d bytes queued for over %d ms\n",
+		       cl->host, queued, CLIENT_STALL_MS);
+		rfbCloseClient(cl);
+	}
+
+	return true;
+}
+
+/*
+ * Whether a client should get an update now: it asked for one, or turned on
+ * continuous updates, and isn't too far behind on what it has been sent.
+ * Something is always let through once the client has caught up.
+ */
+static bool client_ready(rfbClientPtr cl)
+{
+	bool ready;
+	struct ikvm_client *client = cl->clientData;
+	struct flow *flow = &client->flow;
+
+	pthread_mutex_lock(&client->send_lock);
+
+	ready = client->update_pending || flow->continuous;
+	if (ready && flow->fence && flow->sent_bytes > flow->acked_bytes &&
+	    flow->sent_bytes - flow->acked_bytes >= flow->window) {
+		flow->window_full = true;
+		ready = false;
+	}
+
+	if (ready && client->ikvm->max_queued)
+		ready = !client_backlogged(cl, client);
+
+	pthread_mutex_unlock(&client->send_lock);
+
+	return ready;
+}
+
+static void close_flow_client(rfbClientPtr cl, int rc)
+{
+	if (rc)
+		rfbLogPerror("flow: read");
+
+	rfbCloseClient(cl);
+}
+
+static rfbBool handle_fence(rfbClientPtr cl)
+{
+	int rc;
+	uint8_t len;
+	uint32_t flags;
+	struct flow_fence ping;
+	struct ikvm_client *client = cl->clientData;
+	char msg[8 + RFB_FENCE_MAX_PAYLOAD];
+
+	rc = rfbReadExact(cl, msg, 8);
+	if (rc <= 0) {
+		close_flow_client(cl, rc);
+		return TRUE;
+	}
+
+	len = msg[7];
+	if (len > RFB_FENCE_MAX_PAYLOAD) {
+		rfbLog("fence payload too long: %u\n", len);
+		rfbCloseClient(cl);
+		return TRUE;
+	}
+
+	if (len) {
+		rc = rfbReadExact(cl, &msg[8], len);
+		if (rc <= 0) {
+			close_flow_client(cl, rc);
+			return TRUE;
+		}
+	}
+
+	memcpy(&flags, &msg[3], 4);
+	flags = Swap32IfLE(flags);
+
+	pthread_mutex_lock(&client->send_lock);
+
+	if (flags & RFB_FENCE_REQUEST) {
+		/*
+		 * Everything is sent in order and each update in one piece, so
+		 * the block and sync semantics hold by just answering now.
+		 */
+		send_fence(cl, flags & RFB_FENCE_SUPPORTED, len, &msg[8]);
+	} else if (len == sizeof(ping)) {
+		memcpy(&ping, &msg[8], sizeof(ping));
+		flow_acked(cl, &ping);
+	}
+
+	pthread_mutex_unlock(&client->send_lock);
+
+	return TRUE;
+}
+
+static rfbBool handle_continuous_updates(rfbClientPtr cl)
+{
+	int rc;
+	char msg[9];
+	uint8_t type = RFB_CONTINUOUS_UPDATES;
+	struct ikvm_client *client = cl->clientData;
+
+	rc = rfbReadExact(cl, msg, sizeof(msg));
+	if (rc <= 0) {
+		close_flow_client(cl, rc);
+		return TRUE;
+	}
+
+	/*
+	 * The engine captures the whole screen, so the region given with the
+	 * request isn't tracked; viewers ask for all of it anyway.
+	 */
+	pthread_mutex_lock(&client->send_lock);
+
+	client->flow.continuous = msg[0];
+	if (!client->flow.continuous)
+		rfbWriteExact(cl, (char *)&type, 1);
+
+	pthread_mutex_unlock(&client->send_lock);
+
+	return TRUE;
+}
+
+static rfbBool flow_message(rfbClientPtr cl, void *data,
+			    const rfbClientToServerMsg *message)
+{
+	switch (message->type) {
+	case RFB_FENCE:
+		return handle_fence(cl);
+	case RFB_CONTINUOUS_UPDATES:
+		return handle_continuous_updates(cl);
+	}
+
+	return FALSE;
+}
+
+/* Announce support as the extensions require once a client enables them */
+static rfbBool flow_enable(rfbClientPtr cl, void **data, int encoding)
+{
+	uint8_t type = RFB_CONTINUOUS_UPDATES;
+	struct ikvm_client *client = cl->clientData;
+
+	pthread_mutex_lock(&client->send_lock);
+
+	if (encoding == RFB_ENCODING_FENCE && !client->flow.fence) {
+		client->flow.fence = true;
+		send_fence(cl, RFB_FENCE_REQUEST, 0, NULL);
+	} else if (encoding == RFB_ENCODING_CU && !client->flow.cu) {
+		client->flow.cu = true;
+		rfbWriteExact(cl, (char *)&type, 1);
+	}
+
+	pthread_mutex_unlock(&client->send_lock);
+
+	return TRUE;
+}
+
+static int flow_encodings[] = {
+	RFB_ENCODING_FENCE,
+	RFB_ENCODING_CU,
+	0
+};
+
+static rfbProtocolExtension flow_extension = {
+	.pseudoEncodings = flow_encodings,
+	.enablePseudoEncoding = flow_enable,
+	.handleMessage = flow_message,
+};
+
+/*
+ * Frames are only read and sent on behalf of clients that asked for one; a
+ * client that falls behind gets everything it missed with its next update.
+ */
+static void update_request(rfbClientPtr cl,
+			   rfbFramebufferUpdateRequestMsg *fur)
+{
+	struct ikvm_client *client = cl->clientData;
+	struct obmc_ikvm *ikvm = client->ikvm;
+	struct roi roi = {
+		.x = Swap16IfLE(fur->x),
+		.y = Swap16IfLE(fur->y),
+		.w = Swap16IfLE(fur->w),
+		.h = Swap16IfLE(fur->h),
+	};
+	bool has_roi = roi.w && roi.h &&
+		(roi.x || roi.y || roi.x + roi.w < ikvm->resolution.width ||
+		 roi.y + roi.h < ikvm->resolution.height);
+
+	if (!fur->incremental) {
+		client->needs_full = true;
+		client->refined = false;
+		client->fb_seq = 0;
+	}
+
+	pthread_mutex_lock(&client->send_lock);
+
+	if (has_roi && (!client->has_roi ||
+			memcmp(&roi, &client->roi, sizeof(roi)))) {
+		client->roi = roi;
+		client->roi_seq = client->seq;
+		client->rest_ns = now_ns() + (ROI_REST_MS * 1000000ULL);
+	}
+
+	client->has_roi = has_roi;
+
+	pthread_mutex_unlock(&client->send_lock);
+
+	client->update_pending = true;
+}
+
+static bool clients_waiting(struct obmc_ikvm *ikvm)
+{
+	bool waiting = false;
+	rfbClientIteratorPtr iterator = walk_clients(ikvm);
+	rfbClientPtr cl;
+
+	while (!waiting && (cl = next_client(iterator)))
+		waiting = client_ready(cl);
+
+	end_walk(iterator);
+
+	return waiting;
+}
+
+static enum rfbNewClientAction new_client(rfbClientPtr cl)
+{
+	struct obmc_ikvm *ikvm = cl->screen->screenData;
+	struct ikvm_client *client = calloc(1, sizeof(*client));
+
+	if (!client)
+		return RFB_CLIENT_REFUSE;
+
+	/* Past the client limit, connections can only watch */
+	if (ikvm->max_clients &&
+	    ikvm->num_clients - ikvm->num_spectators >= ikvm->max_clients) {
+		if (ikvm->num_spectators >= ikvm->max_spectators) {
+			printf("refusing client %s: %d clients and %d "
+			       "spectators connected\n", cl->host,
+			       ikvm->num_clients - ikvm->num_spectators,
+			       ikvm->num_spectators);
+			free(client);
+			return RFB_CLIENT_REFUSE;
+		}
+
+		client->spectator = true;
+		cl->viewOnly = TRUE;
+		ikvm->num_spectators++;
+	}
+
+	client->ikvm = ikvm;
+	client->needs_full = true;
+	client->flow.window = FLOW_WINDOW_MIN;
+	pthread_mutex_init(&client->send_lock, NULL);
+
+	/* Other threads see the client from here on */
+	__atomic_store_n(&cl->clientData, client, __ATOMIC_RELEASE);
+	cl->clientGoneHook = client_gone;
+	cl->clientFramebufferUpdateRequestHook = update_request;
+
+	ikvm->num_clients++;
+	ikvm->delay_count = ikvm->frame_rate;
+
+	return RFB_CLIENT_ACCEPT;
+}
+
+#ifdef _TLS_
+static int tls_accept(SSL *ssl, int fd)
+{
+	int rc;
+	struct pollfd pfd = { .fd = fd };
+
+	while ((rc = SSL_accept(ssl)) != 1) {
+		switch (SSL_get_error(ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+			pfd.events = POLLIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			pfd.events = POLLOUT;
+			break;
+		default:
+			rfbLog("tls handshake failed: %s\n",
+			       ERR_error_string(ERR_get_error(), NULL));
+			return -EPROTO;
+		}
+
+		rc = poll(&pfd, 1, TLS_HANDSHAKE_MS);
+		if (rc <= 0)
+			return rc ? -errno : -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/*
+ * VeNCrypt with the X509None subtype: negotiate in the clear, run the TLS
+ * handshake in userspace and leave the session keys with the kernel. From
+ * then on libvncserver's plain reads and writes on the socket, frames
+ * included, are encrypted by kTLS without any copy through OpenSSL.
+ */
+static int vencrypt_handshake(struct obmc_ikvm *ikvm, rfbClientPtr cl)
+{
+	uint8_t version[2] = { 0, 2 };
+	uint8_t subtypes[5] = { 1 };
+	uint8_t ack;
+	uint32_t subtype = Swap32IfLE(VENCRYPT_X509_NONE);
+	uint32_t result = 0;
+	SSL *ssl;
+
+	if (rfbWriteExact(cl, (char *)version, sizeof(version)) < 0 ||
+	    rfbReadExact(cl, (char *)version, sizeof(version)) <= 0)
+		return -EIO;
+
+	ack = version[0] != 0 || version[1] != 2;
+	if (rfbWriteExact(cl, (char *)&ack, 1) < 0 || ack)
+		return -EPROTO;
+
+	memcpy(&subtypes[1], &subtype, sizeof(subtype));
+	if (rfbWriteExact(cl, (char *)subtypes, sizeof(subtypes)) < 0 ||
+	    rfbReadExact(cl, (char *)&subtype, sizeof(subtype)) <= 0)
+		return -EIO;
+
+	ack = Swap32IfLE(subtype) == VENCRYPT_X509_NONE;
+	if (rfbWriteExact(cl, (char *)&ack, 1) < 0 || !ack)
+		return -EPROTO;
+
+	ssl = SSL_new(ikvm->tls_ctx);
+	if (!ssl)
+		return -ENOMEM;
+
+	if (!SSL_set_fd(ssl, cl->sock) || tls_accept(ssl, cl->sock)) {
+		SSL_free(ssl);
+		return -EPROTO;
+	}
+
+	if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+	    !BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		rfbLog("kernel tls not available for %s\n", cl->host);
+		SSL_free(ssl);
+		return -ENOTSUP;
+	}
+
+	/* The kernel holds the session now; the socket itself stays open */
+	SSL_free(ssl);
+
+	if (cl->protocolMinorVersion > 7 &&
+	    rfbWriteExact(cl, (char *)&result, sizeof(result)) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+static void *vencrypt_thread(void *ptr)
+{
+	struct tls_handshake *hs = (struct tls_handshake *)ptr;
+	rfbClientPtr cl = hs->cl;
+	struct obmc_ikvm *ikvm = cl->screen->screenData;
+
+	hs->rc = vencrypt_handshake(ikvm, cl);
+
+	pthread_mutex_lock(&tls_mutex);
+	hs->next = ikvm->tls_done;
+	ikvm->tls_done = hs;
+	pthread_mutex_unlock(&tls_mutex);
+
+	rfbDecrClientRef(cl);
+
+	return NULL;
+}
+
+/*
+ * A slow or hostile client could hold the rfb thread, and with it input
+ * and every other session, for as long as its handshake lasts. So the
+ * socket is taken out of libvncserver's set and handed to a thread of its
+ * own, and poll_tls() gives it back once the session is set up.
+ */
+static void vencrypt_auth(rfbClientPtr cl)
+{
+	pthread_t thread;
+	struct tls_handshake *hs = calloc(1, sizeof(*hs));
+
+	if (!hs) {
+		rfbCloseClient(cl);
+		return;
+	}
+
+	hs->cl = cl;
+	FD_CLR(cl->sock, &cl->screen->allFds);
+	rfbIncrClientRef(cl);
+
+	if (pthread_create(&thread, NULL, vencrypt_thread, hs)) {
+		rfbLog("failed to start tls handshake for %s\n", cl->host);
+		rfbDecrClientRef(cl);
+		FD_SET(cl->sock, &cl->screen->allFds);
+		rfbCloseClient(cl);
+		free(hs);
+		return;
+	}
+
+	pthread_detach(thread);
+}
+
+static bool client_connected(struct obmc_ikvm *ikvm, rfbClientPtr cl)
+{
+	rfbClientIteratorPtr iterator =
+		rfbGetClientIteratorWithClosed(ikvm->server);
+	rfbClientPtr c;
+
+	while ((c = rfbClientIteratorNext(iterator)) && c != cl)
+		;
+
+	rfbReleaseClientIterator(iterator);
+
+	return c == cl;
+}
+
+/* Run by the rfb thread: let finished handshakes' clients carry on */
+static void poll_tls(struct obmc_ikvm *ikvm)
+{
+	struct tls_handshake *hs;
+	struct tls_handshake *done;
+
+	pthread_mutex_lock(&tls_mutex);
+	done = ikvm->tls_done;
+	ikvm->tls_done = NULL;
+	pthread_mutex_unlock(&tls_mutex);
+
+	while ((hs = done)) {
+		done = hs->next;
+
+		if (client_connected(ikvm, hs->cl) && hs->cl->sock >= 0) {
+			FD_SET(hs->cl->sock, &ikvm->server->allFds);
+
+			if (hs->rc)
+				rfbCloseClient(hs->cl);
+			else
+				hs->cl->state = RFB_INITIALISATION;
+		}
+
+		free(hs);
+	}
+}
+
+static rfbSecurityHandler vencrypt_handler = {
+	.type = RFB_SEC_VENCRYPT,
+	.handler = vencrypt_auth,
+};
+
+static rfbBool refuse_password(rfbClientPtr cl, const char *response,
+			       int len)
+{
+	return FALSE;
+}
+
+static int init_tls(struct obmc_ikvm *ikvm)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+	if (!ctx) {
+		printf("failed to create tls context\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * kTLS takes over a TLS 1.2 session with an AES-GCM suite; tickets and
+	 * renegotiation would put records on the socket only OpenSSL handles.
+	 */
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_TICKET |
+			    SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION);
+
+	if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) ||
+	    SSL_CTX_use_certificate_chain_file(ctx, ikvm->tls_cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, ikvm->tls_key,
+					SSL_FILETYPE_PEM) != 1 ||
+	    !SSL_CTX_check_private_key(ctx)) {
+		printf("failed to load tls certificate %s and key %s: %s\n",
+		       ikvm->tls_cert, ikvm->tls_key,
+		       ERR_error_string(ERR_get_error(), NULL));
+		SSL_CTX_free(ctx);
+		return -EINVAL;
+	}
+
+	ikvm->tls_ctx = ctx;
+	rfbRegisterSecurityHandler(&vencrypt_handler);
+
+	/*
+	 * libvncserver always offers None, or VncAuth when there are
+	 * passwords, next to the registered types. Offer VncAuth and fail it
+	 * so that only encrypted sessions get through.
+	 */
+	ikvm->server->authPasswdData = ikvm;
+	ikvm->server->passwordCheck = refuse_password;
+
+	return 0;
+}
+#else
+static int init_tls(struct obmc_ikvm *ikvm)
+{
+	printf("built without tls support\n");
+
+	return -ENOTSUP;
+}
+
+static void poll_tls(struct obmc_ikvm *ikvm)
+{
+}
+#endif /* _TLS_ */
+
+static int init_server(struct obmc_ikvm *ikvm, int *argc, char **argv)
+{
+	rfbPixelFormat *format;
+
+	ikvm->server = rfbGetScreen(argc, argv, ikvm->resolution.width,
+				    ikvm->resolution.height, BITS_PER_SAMPLE,
+				    SAMPLES_PER_PIXEL, BYTES_PER_PIXEL);
+	if (!ikvm->server) {
+		printf("failed to get vnc screen\n");
+		return -ENODEV;
+	}
+
+	ikvm->server->screenData = ikvm;
+	ikvm->server->desktopName = "AST2XXX Video Engine";
+	ikvm->server->frameBuffer = ikvm->fb;
+	ikvm->server->alwaysShared = true;
+	ikvm->server->newClientHook = new_client;
+
+	/* The host's pointer is in the captured picture already */
+	ikvm->server->cursor = NULL;
+	ikvm->fb_seq = 1;
+
+	rfbRegisterProtocolExtension(&flow_extension);
+	rfbInitServer(ikvm->server);
+
+	format = &ikvm->server->serverFormat;
+	format->redMax = 31;
+	format->greenMax = 63;
+	format->blueMax = 31;
+	format->redShift = 11;
+	format->greenShift = 5;
+	format->blueShift = 0;
+
+	return 0;
+}
+
+/* Queue data behind what's in the client's update buffer, flushing as it fills */
+static rfbBool append_update(rfbClientPtr cl, const char *data, size_t len)
+{
+	/* Big chunks go to the socket straight from the capture buffer */
+	if (len >= UPDATE_BUF_SIZE) {
+		if (cl->ublen && !rfbSendUpdateBuf(cl))
+			return FALSE;
+
+		if (rfbWriteExact(cl, data, len) < 0) {
+			rfbLogPerror("append_update: write");
+			rfbCloseClient(cl);
+			return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	while (len) {
+		size_t copy_len = UPDATE_BUF_SIZE - cl->ublen;
+
+		if (!copy_len) {
+			if (!rfbSendUpdateBuf(cl)) {
+				rfbLog("rfbSendUpdateBuf FAIL\n");
+				return FALSE;
+			}
+
+			continue;
+		}
+
+		if (copy_len > len)
+			copy_len = len;
+
+		memcpy(&cl->updateBuf[cl->ublen], data, copy_len);
+		cl->ublen += copy_len;
+		data += copy_len;
+		len -= copy_len;
+	}
+
+	return TRUE;
+}
+
+static void start_update(rfbClientPtr cl, int num_rects)
+{
+	rfbFramebufferUpdateMsg *fu =
+		(rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+	fu->type = rfbFramebufferUpdate;
+
+	if (cl->enableLastRectEncoding)
+		fu->nRects = 0xFFFF;
+	else
+		fu->nRects = Swap16IfLE(num_rects);
+
+	cl->ublen = sz_rfbFramebufferUpdateMsg;
+}
+
+static rfbBool finish_update(rfbClientPtr cl, struct obmc_ikvm *ikvm,
+			     size_t size)
+{
+	rfbBool rc;
+	unsigned long long start_ns;
+
+	if (cl->enableLastRectEncoding)
+		rfbSendLastRectMarker(cl);
+
+	start_ns = now_ns();
+	rc = rfbSendUpdateBuf(cl);
+	trace_frame(ikvm, TRACE_FLUSH, cl->sock, size, start_ns);
+
+	return rc;
+}
+
+/* Send the engine's output as is; it already carries nRects rect headers */
+static rfbBool
+rfbHextile16(rfbClientPtr cl, struct obmc_ikvm *ikvm) {
+	if (ikvm->frame_size == 0)
+		return TRUE;
+
+	start_update(cl, ikvm->nRects);
+
+	if (!append_update(cl, ikvm->frame, ikvm->frame_size))
+		return FALSE;
+
+	return finish_update(cl, ikvm, ikvm->frame_size);
+}
+
+/* Called with the client's send lock held */
+static rfbBool send_new_fb_size(rfbClientPtr cl, struct obmc_ikvm *ikvm)
+{
+	if (!cl->useNewFBSize || !cl->newFBSizePending)
+		return TRUE;
+
+	cl->newFBSizePending = FALSE;
+
+	start_update(cl, 1);
+
+	if (!rfbSendNewFBSize(cl, ikvm->resolution.width,
+			      ikvm->resolution.height))
+		return FALSE;
+
+	return finish_update(cl, ikvm, 0);
+}
+
+/*
+ * Send libvncserver's framebuffer, which only ever holds the no signal
+ * screen. It is real pixels, so libvncserver's own hextile encoder is used.
+ * Called with the client's send lock held.
+ */
+static rfbBool send_fb(rfbClientPtr cl, struct obmc_ikvm *ikvm)
+{
+	start_update(cl, 1);
+
+	if (!rfbSendRectEncodingHextile(cl, 0, 0, ikvm->resolution.width,
+					ikvm->resolution.height))
+		return FALSE;
+
+	return finish_update(cl, ikvm, ikvm->fb_size);
+}
+
+static int parse_opaque(struct obmc_ikvm *ikvm)
+{
+	ikvm->frame_is_full = true;
+
+	return 0;
+}
+
+/* Every frame is complete, so the latest one is all any client needs */
+static int send_opaque(rfbClientPtr cl, struct obmc_ikvm *ikvm)
+{
+	if (!rfbHextile16(cl, ikvm))
+		return -1;
+
+	return ikvm->frame_size;
+}
+
+static const struct video_backend opaque_backend = {
+	.name = "opaque",
+	.parse = parse_opaque,
+	.send = send_opaque,
+};
+
+static unsigned int hash_data(const char *data, size_t len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--) {
+		hash ^= (unsigned char)*data++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/* Length of a 16bpp hextile encoded rectangle, or -1 if it overruns size */
+static long hextile_len(const unsigned char *data, size_t size, int w, int h)
+{
+	int x;
+	int y;
+	size_t pos = 0;
+
+	for (y = 0; y < h; y += HEXTILE_SIZE) {
+		int th = h - y < HEXTILE_SIZE ? h - y : HEXTILE_SIZE;
+
+		for (x = 0; x < w; x += HEXTILE_SIZE) {
+			int tw = w - x < HEXTILE_SIZE ? w - x : HEXTILE_SIZE;
+			unsigned char sub;
+
+			if (pos >= size)
+				return -1;
+
+			sub = data[pos++];
+			if (sub & rfbHextileRaw) {
+				pos += tw * th * BYTES_PER_PIXEL;
+				continue;
+			}
+
+			if (sub & rfbHextileBackgroundSpecified)
+				pos += BYTES_PER_PIXEL;
+
+			if (sub & rfbHextileForegroundSpecified)
+				pos += BYTES_PER_PIXEL;
+
+			if (sub & rfbHextileAnySubrects) {
+				unsigned int n;
+
+				if (pos >= size)
+					return -1;
+
+				n = data[pos++];
+				if (sub & rfbHextileSubrectsColoured)
+					pos += n * (2 + BYTES_PER_PIXEL);
+				else
+					pos += n * 2;
+			}
+		}
+	}
+
+	return pos > size ? -1 : (long)pos;
+}
+
+static unsigned long long rect_key(struct video_rect *r)
+{
+	return (unsigned long long)r->x | ((unsigned long long)r->y << 16) |
+		((unsigned long long)r->w << 32) |
+		((unsigned long long)r->h << 48);
+}
+
+static struct rect_entry *rect_slot(struct rect_entry *table,
+				    unsigned int size, unsigned long long key)
+{
+	unsigned int i = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+	for (;; ++i) {
+		struct rect_entry *e = &table[i & (size - 1)];
+
+		if (!e->key || e->key == key)
+			return e;
+	}
+}
+
+static void set_needs_full(struct obmc_ikvm *ikvm)
+{
+	rfbClientIteratorPtr iterator = walk_clients(ikvm);
+	rfbClientPtr cl;
+
+	while ((cl = next_client(iterator))) {
+		struct ikvm_client *client = cl->clientData;
+
+		client->needs_full = true;
+	}
+
+	end_walk(iterator);
+}
+
+/* Forget every cached rect; clients need a full frame to catch up again */
+static void reset_rect_table(struct obmc_ikvm *ikvm)
+{
+	unsigned int i;
+
+	for (i = 0; i < ikvm->rect_table_size; ++i)
+		free(ikvm->rect_table[i].data);
+
+	if (ikvm->rect_table)
+		memset(ikvm->rect_table, 0,
+		       ikvm->rect_table_size * sizeof(struct rect_entry));
+
+	ikvm->rect_table_used = 0;
+	ikvm->rect_cache_bytes = 0;
+	ikvm->rect_cache_valid = false;
+
+	set_needs_full(ikvm);
+}
+
+/* Look up the entry for a rect geometry, growing the table as it fills */
+static struct rect_entry *rect_entry(struct obmc_ikvm *ikvm,
+				     struct video_rect *r)
+{
+	unsigned int i;
+	unsigned long long key = rect_key(r);
+	struct rect_entry *e;
+
+	if ((ikvm->rect_table_used + 1) * 2 > ikvm->rect_table_size) {
+		unsigned int size = ikvm->rect_table_size ?
+			ikvm->rect_table_size * 2 : RECT_TABLE_MIN;
+		struct rect_entry *table;
+
+		/* Rect geometries keep changing; start over */
+		if (size > RECT_TABLE_MAX) {
+			reset_rect_table(ikvm);
+			goto lookup;
+		}
+
+		table = calloc(size, sizeof(*table));
+		if (!table)
+			return NULL;
+
+		for (i = 0; i < ikvm->rect_table_size; ++i) {
+			e = &ikvm->rect_table[i];
+			if (e->key)
+				*rect_slot(table, size, e->key) = *e;
+		}
+
+		free(ikvm->rect_table);
+		ikvm->rect_table = table;
+		ikvm->rect_table_size = size;
+	}
+
+lookup:
+	e = rect_slot(ikvm->rect_table, ikvm->rect_table_size, key);
+	if (!e->key) {
+		e->key = key;
+		ikvm->rect_table_used++;
+	}
+
+	return e;
+}
+
+static int cache_rect(struct obmc_ikvm *ikvm, struct rect_entry *e,
+		      struct video_rect *r)
+{
+	if (r->len > e->size) {
+		char *data = realloc(e->data, r->len);
+
+		if (!data)
+			return -ENOMEM;
+
+		ikvm->rect_cache_bytes += r->len - e->size;
+		e->data = data;
+		e->size = r->len;
+	}
+
+	memcpy(e->data, &ikvm->frame[r->offset], r->len);
+	e->len = r->len;
+	e->hash = r->hash;
+	e->seq = ++ikvm->rect_seq;
+
+	return 0;
+}
+
+/*
+ * The rect seq that last drew over each hextile-sized tile. Content a
+ * geometry had cached is only still on screen if nothing newer has drawn
+ * over any of it since, whatever geometry that came in.
+ */
+static int alloc_tiles(struct obmc_ikvm *ikvm)
+{
+	unsigned int w = (ikvm->resolution.width + HEXTILE_SIZE - 1) /
+		HEXTILE_SIZE;
+	unsigned int h = (ikvm->resolution.height + HEXTILE_SIZE - 1) /
+		HEXTILE_SIZE;
+	unsigned long long *tile_seq;
+
+	if (w == ikvm->tiles_w && h == ikvm->tiles_h)
+		return 0;
+
+	tile_seq = calloc(w * h, sizeof(*tile_seq));
+	if (!tile_seq)
+		return -ENOMEM;
+
+	free(ikvm->tile_seq);
+	ikvm->tile_seq = tile_seq;
+	ikvm->tiles_w = w;
+	ikvm->tiles_h = h;
+
+	return 0;
+}
+
+/* Stamp the tiles under r with seq, or find whether any is newer than it */
+static bool rect_tiles(struct obmc_ikvm *ikvm, struct video_rect *r,
+		       unsigned long long seq, bool mark)
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int x0 = r->x / HEXTILE_SIZE;
+	unsigned int x1 = (r->x + r->w - 1) / HEXTILE_SIZE;
+	unsigned int y0 = r->y / HEXTILE_SIZE;
+	unsigned int y1 = (r->y + r->h - 1) / HEXTILE_SIZE;
+
+	for (y = y0; y <= y1; ++y) {
+		unsigned long long *row = &ikvm->tile_seq[y * ikvm->tiles_w];
+
+		for (x = x0; x <= x1; ++x) {
+			if (mark)
+				row[x] = seq;
+			else if (row[x] > seq)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Split a Nuvoton ECE frame into its rectangles, work out which of them
+ * differ from what was last seen at the same place and keep their content
+ * for clients that haven't received it yet.
+ */
+static int parse_rects(struct obmc_ikvm *ikvm)
+{
+	int i;
+	int rc;
+	size_t pos = 0;
+	unsigned long long area = 0;
+	const unsigned char *frame = (const unsigned char *)ikvm->frame;
+
+	ikvm->num_rects = 0;
+	ikvm->num_changed = 0;
+	ikvm->frame_seq = ikvm->rect_seq;
+
+	rc = alloc_tiles(ikvm);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < ikvm->nRects; ++i) {
+		long len;
+		struct rect_entry *e;
+		struct video_rect *r;
+		rfbFramebufferUpdateRectHeader hdr;
+
+		if (pos + sz_rfbFramebufferUpdateRectHeader > ikvm->frame_size)
+			return -EINVAL;
+
+		if (ikvm->num_rects == ikvm->rects_size) {
+			unsigned int size = ikvm->rects_size ?
+				ikvm->rects_size * 2 : RECT_TABLE_MIN;
+
+			r = realloc(ikvm->rects, size * sizeof(*r));
+			if (!r)
+				return -ENOMEM;
+
+			ikvm->rects = r;
+			ikvm->rects_size = size;
+		}
+
+		memcpy(&hdr, &frame[pos], sz_rfbFramebufferUpdateRectHeader);
+
+		r = &ikvm->rects[ikvm->num_rects];
+		r->x = Swap16IfLE(hdr.r.x);
+		r->y = Swap16IfLE(hdr.r.y);
+		r->w = Swap16IfLE(hdr.r.w);
+		r->h = Swap16IfLE(hdr.r.h);
+		r->encoding = Swap32IfLE(hdr.encoding);
+		r->offset = pos;
+
+		if (!r->w || !r->h ||
+		    r->x + r->w > ikvm->resolution.width ||
+		    r->y + r->h > ikvm->resolution.height)
+			return -EINVAL;
+
+		pos += sz_rfbFramebufferUpdateRectHeader;
+
+		if (r->encoding == rfbEncodingHextile)
+			len = hextile_len(&frame[pos], ikvm->frame_size - pos,
+					  r->w, r->h);
+		else if (r->encoding == rfbEncodingRaw)
+			len = r->w * r->h * BYTES_PER_PIXEL;
+		else
+			len = -1;
+
+		if (len < 0 || pos + len > ikvm->frame_size)
+			return -EINVAL;
+
+		pos += len;
+		r->len = pos - r->offset;
+		r->hash = hash_data(&ikvm->frame[r->offset], r->len);
+		area += r->w * r->h;
+
+		ikvm->num_rects++;
+
+		e = rect_entry(ikvm, r);
+		if (!e)
+			return -ENOMEM;
+
+		/* Equal hashes aren't proof; neither is an overdrawn entry */
+		r->changed = !e->data || e->hash != r->hash ||
+			e->len != r->len ||
+			memcmp(e->data, &ikvm->frame[r->offset], r->len) ||
+			rect_tiles(ikvm, r, e->seq, false);
+		if (r->changed) {
+			rc = cache_rect(ikvm, e, r);
+			if (rc)
+				return rc;
+
+			rect_tiles(ikvm, r, e->seq, true);
+			ikvm->num_changed++;
+		}
+	}
+
+	/*
+	 * The engine sends everything after being opened or changing mode,
+	 * and only what changed after that.
+	 */
+	ikvm->frame_is_full = ikvm->video_fresh ||
+		area >= ikvm->resolution.width * ikvm->resolution.height;
+
+	if (ikvm->frame_is_full)
+		ikvm->rect_cache_valid = true;
+
+	/* Geometries that keep moving leave stale entries behind */
+	if (ikvm->rect_cache_bytes > ikvm->frame_buf_size * RECT_CACHE_FRAMES)
+		reset_rect_table(ikvm);
+
+	return 0;
+}
+
+static int cmp_rect_seq(const void *a, const void *b)
+{
+	const struct rect_entry *x = *(const struct rect_entry **)a;
+	const struct rect_entry *y = *(const struct rect_entry **)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static bool rect_in_roi(unsigned long long key, const struct roi *roi)
+{
+	unsigned int x = key & 0xffff;
+	unsigned int y = (key >> 16) & 0xffff;
+	unsigned int w = (key >> 32) & 0xffff;
+	unsigned int h = key >> 48;
+
+	return x < roi->x + roi->w && roi->x < x + w &&
+		y < roi->y + roi->h && roi->y < y + h;
+}
+
+/*
+ * Collect the cached rects that changed after seq in ikvm->sorted, by age,
+ * leaving out those that miss roi if there is one.
+ */
+static int sort_cached_rects(struct obmc_ikvm *ikvm, unsigned long long seq,
+			     const struct roi *roi)
+{
+	unsigned int i;
+	int count = 0;
+
+	if (ikvm->sorted_size < ikvm->rect_table_used) {
+		struct rect_entry **sorted = realloc(ikvm->sorted,
+			ikvm->rect_table_used * sizeof(*sorted));
+
+		if (!sorted)
+			return -ENOMEM;
+
+		ikvm->sorted = sorted;
+		ikvm->sorted_size = ikvm->rect_table_used;
+	}
+
+	for (i = 0; i < ikvm->rect_table_size; ++i) {
+		struct rect_entry *e = &ikvm->rect_table[i];
+
+		if (e->data && e->seq > seq && (!roi || rect_in_roi(e->key, roi)))
+			ikvm->sorted[count++] = e;
+	}
+
+	qsort(ikvm->sorted, count, sizeof(*ikvm->sorted), cmp_rect_seq);
+
+	return count;
+}
+
+static int send_cached_rects(rfbClientPtr cl, struct obmc_ikvm *ikvm,
+			     unsigned long long seq, const struct roi *roi)
+{
+	int i;
+	int count;
+	size_t size = 0;
+
+	count = sort_cached_rects(ikvm, seq, roi);
+	if (count <= 0)
+		return count < 0 ? -1 : 0;
+
+	start_update(cl, count);
+
+	for (i = 0; i < count; ++i) {
+		if (!append_update(cl, ikvm->sorted[i]->data,
+				   ikvm->sorted[i]->len))
+			return -1;
+
+		size += ikvm->sorted[i]->len;
+	}
+
+	return finish_update(cl, ikvm, size) ? (int)size : -1;
+}
+
+/*
+ * Send a client what it's missing: the rects that changed in this frame if it
+ * had everything before it, or what changed since it was last updated. A
+ * client with a region of interest gets what changed there until the rest of
+ * the screen is due, and then everything it's missing.
+ */
+static int send_rects(rfbClientPtr cl, struct obmc_ikvm *ikvm)
+{
+	int rc;
+	unsigned int i;
+	size_t size = 0;
+	struct ikvm_client *client = cl->clientData;
+
+	if (client->needs_full && !ikvm->rect_cache_valid) {
+		/* Nothing to build a full frame from; have the engine send one */
+		ikvm->reset_video = true;
+		return 0;
+	}
+
+	if (client->has_roi && !client->needs_full &&
+	    now_ns() < client->rest_ns) {
+		rc = send_cached_rects(cl, ikvm, client->roi_seq,
+				       &client->roi);
+		if (rc >= 0)
+			client->roi_seq = ikvm->rect_seq;
+
+		return rc;
+	}
+
+	if (client->needs_full || client->seq < ikvm->frame_seq) {
+		rc = send_cached_rects(cl, ikvm,
+				       client->needs_full ? 0 : client->seq,
+				       NULL);
+		goto done;
+	}
+
+	if (!ikvm->num_changed)
+		return 0;
+
+	start_update(cl, ikvm->num_changed);
+
+	for (i = 0; i < ikvm->num_rects; ) {
+		struct video_rect *r = &ikvm->rects[i++];
+		unsigned int start = r->offset;
+		unsigned int end = r->offset + r->len;
+
+		if (!r->changed)
+			continue;
+
+		/* Rects that are next to each other in the frame go in one go */
+		while (i < ikvm->num_rects && ikvm->rects[i].changed &&
+		       ikvm->rects[i].offset == end) {
+			end += ikvm->rects[i].len;
+			i++;
+		}
+
+		if (!append_update(cl, &ikvm->frame[start], end - start))
+			return -1;
+
+		size += end - start;
+	}
+
+	rc = finish_update(cl, ikvm, size) ? (int)size : -1;
+
+done:
+	if (rc > 0) {
+		client->needs_full = false;
+		client->seq = ikvm->rect_seq;
+		client->roi_seq = ikvm->rect_seq;
+		client->rest_ns = now_ns() + (ROI_REST_MS * 1000000ULL);
+	}
+
+	return rc;
+}
+
+static const struct video_backend rects_backend = {
+	.name = "rects",
+	.parse = parse_rects,
+	.send = send_rects,
+};
+
+static void thumb_fill(struct thumb *t, int x, int y, int w, int h,
+		       const unsigned char *pixel)
+{
+	int tx;
+	int ty;
+	int x0 = (x + t->scale - 1) / t->scale;
+	int y0 = (y + t->scale - 1) / t->scale;
+	int x1 = (x + w + t->scale - 1) / t->scale;
+	int y1 = (y + h + t->scale - 1) / t->scale;
+
+	if (x1 > t->width)
+		x1 = t->width;
+	if (y1 > t->height)
+		y1 = t->height;
+
+	for (ty = y0; ty < y1; ++ty)
+		for (tx = x0; tx < x1; ++tx)
+			memcpy(&t->fb[(ty * t->width + tx) * BYTES_PER_PIXEL],
+			       pixel, BYTES_PER_PIXEL);
+}
+
+/*
+ * Decode a hextile rect straight into the thumbnail, keeping only every
+ * scale'th pixel of every scale'th row; nothing is drawn at full size.
+ */
+static long thumb_hextile(struct thumb *t, const unsigned char *data,
+			  size_t size, int rx, int ry, int w, int h)
+{
+	int x;
+	int y;
+	size_t pos = 0;
+	unsigned char bg[BYTES_PER_PIXEL] = { 0 };
+	unsigned char fg[BYTES_PER_PIXEL] = { 0 };
+
+	for (y = 0; y < h; y += HEXTILE_SIZE) {
+		int th = h - y < HEXTILE_SIZE ? h - y : HEXTILE_SIZE;
+
+		for (x = 0; x < w; x += HEXTILE_SIZE) {
+			int tw = w - x < HEXTILE_SIZE ? w - x : HEXTILE_SIZE;
+			unsigned char sub;
+			unsigned int n;
+
+			if (pos >= size)
+				return -1;
+
+			sub = data[pos++];
+			if (sub & rfbHextileRaw) {
+				int px;
+				int py;
+
+				if (pos + tw * th * BYTES_PER_PIXEL > size)
+					return -1;
+
+				for (py = 0; py < th; ++py)
+					for (px = 0; px < tw; ++px)
+						thumb_fill(t, rx + x + px,
+							   ry + y + py, 1, 1,
+							   &data[pos +
+							   (py * tw + px) *
+							   BYTES_PER_PIXEL]);
+
+				pos += tw * th * BYTES_PER_PIXEL;
+				continue;
+			}
+
+			if (sub & rfbHextileBackgroundSpecified) {
+				if (pos + BYTES_PER_PIXEL > size)
+					return -1;
+
+				memcpy(bg, &data[pos], BYTES_PER_PIXEL);
+				pos += BYTES_PER_PIXEL;
+			}
+
+			thumb_fill(t, rx + x, ry + y, tw, th, bg);
+
+			if (sub & rfbHextileForegroundSpecified) {
+				if (pos + BYTES_PER_PIXEL > size)
+					return -1;
+
+				memcpy(fg, &data[pos], BYTES_PER_PIXEL);
+				pos += BYTES_PER_PIXEL;
+			}
+
+			if (!(sub & rfbHextileAnySubrects))
+				continue;
+
+			if (pos >= size)
+				return -1;
+
+			for (n = data[pos++]; n; --n) {
+				const unsigned char *pixel = fg;
+				unsigned char xy;
+				unsigned char wh;
+
+				if (sub & rfbHextileSubrectsColoured) {
+					if (pos + BYTES_PER_PIXEL > size)
+						return -1;
+
+					pixel = &data[pos];
+					pos += BYTES_PER_PIXEL;
+				}
+
+				if (pos + 2 > size)
+					return -1;
+
+				xy = data[pos++];
+				wh = data[pos++];
+				thumb_fill(t, rx + x + rfbHextileExtractX(xy),
+					   ry + y + rfbHextileExtractY(xy),
+					   rfbHextileExtractW(wh),
+					   rfbHextileExtractH(wh), pixel);
+			}
+		}
+	}
+
+	return pos;
+}
+
+/*
+ * Draw one rect, header included, as found in the rect cache or the engine's
+ * output; returns how many bytes it took up, or -1 if it was cut short.
+ */
+static long thumb_rect(struct thumb *t, const char *data, size_t len)
+{
+	int x;
+	int y;
+	int w;
+	int h;
+	long rc;
+	rfbFramebufferUpdateRectHeader hdr;
+	const unsigned char *pixels = (const unsigned char *)data +
+		sz_rfbFramebufferUpdateRectHeader;
+
+	if (len < sz_rfbFramebufferUpdateRectHeader)
+		return -1;
+
+	memcpy(&hdr, data, sz_rfbFramebufferUpdateRectHeader);
+	x = Swap16IfLE(hdr.r.x);
+	y = Swap16IfLE(hdr.r.y);
+	w = Swap16IfLE(hdr.r.w);
+	h = Swap16IfLE(hdr.r.h);
+	len -= sz_rfbFramebufferUpdateRectHeader;
+
+	if (Swap32IfLE(hdr.encoding) == rfbEncodingHextile) {
+		rc = thumb_hextile(t, pixels, len, x, y, w, h);
+		if (rc < 0)
+			return -1;
+	} else if (Swap32IfLE(hdr.encoding) != rfbEncodingRaw) {
+		/* No telling how long anything else is */
+		return -1;
+	} else {
+		int px;
+		int py;
+
+		rc = (long)w * h * BYTES_PER_PIXEL;
+		if ((size_t)rc > len)
+			return -1;
+
+		for (py = 0; py < h; ++py)
+			for (px = 0; px < w; ++px)
+				thumb_fill(t, x + px, y + py, 1, 1,
+					   &pixels[(py * w + px) *
+					   BYTES_PER_PIXEL]);
+	}
+
+	return sz_rfbFramebufferUpdateRectHeader + rc;
+}
+
+static bool thumb_due(struct obmc_ikvm *ikvm)
+{
+	struct thumb *t = &ikvm->thumb;
+
+	return t->server && t->server->clientHead && now_ns() >= t->next_ns;
+}
+
+/* Refresh the thumbnail from the frame just captured, once per interval */
+static void update_thumb(struct obmc_ikvm *ikvm)
+{
+	int i;
+	int count;
+	struct thumb *t = &ikvm->thumb;
+
+	if (!thumb_due(ikvm))
+		return;
+
+	if (ikvm->backend == &opaque_backend) {
+		size_t pos = 0;
+
+		t->next_ns = now_ns() + THUMB_INTERVAL_MS * 1000000ULL;
+
+		/* The engine's output is nRects rects, each with its header */
+		for (i = 0; i < ikvm->nRects; ++i) {
+			long len = thumb_rect(t, &ikvm->frame[pos],
+					      ikvm->frame_size - pos);
+
+			if (len < 0)
+				return;
+
+			pos += len;
+		}
+	} else {
+		/*
+		 * Only what changed since the last refresh needs drawing; with
+		 * nothing drawn yet, wait for the next full frame.
+		 */
+		if (!t->seq && !ikvm->rect_cache_valid)
+			return;
+
+		t->next_ns = now_ns() + THUMB_INTERVAL_MS * 1000000ULL;
+
+		count = sort_cached_rects(ikvm, t->seq, NULL);
+		if (count <= 0)
+			return;
+
+		for (i = 0; i < count; ++i)
+			thumb_rect(t, ikvm->sorted[i]->data,
+				   ikvm->sorted[i]->len);
+
+		t->seq = ikvm->rect_seq;
+	}
+
+	rfbMarkRectAsModified(t->server, 0, 0, t->width, t->height);
+}
+
+/* Called with the rfb thread held off, like the main framebuffer change */
+static int resize_thumb(struct obmc_ikvm *ikvm)
+{
+	struct thumb *t = &ikvm->thumb;
+	int width = (ikvm->resolution.width + t->scale - 1) / t->scale;
+	int height = (ikvm->resolution.height + t->scale - 1) / t->scale;
+	char *fb = calloc(width * height, BYTES_PER_PIXEL);
+
+	if (!fb)
+		return -ENOMEM;
+
+	if (t->server)
+		rfbNewFramebuffer(t->server, fb, width, height,
+				  BITS_PER_SAMPLE, SAMPLES_PER_PIXEL,
+				  BYTES_PER_PIXEL);
+
+	free(t->fb);
+	t->fb = fb;
+	t->width = width;
+	t->height = height;
+	t->seq = 0;
+	t->next_ns = 0;
+
+	return 0;
+}
+
+static enum rfbNewClientAction new_thumb_client(rfbClientPtr cl)
+{
+	cl->viewOnly = TRUE;
+
+	return RFB_CLIENT_ACCEPT;
+}
+
+static int init_thumb(struct obmc_ikvm *ikvm)
+{
+	int argc = 1;
+	char *argv[] = { "obmc-ikvm", NULL };
+	struct thumb *t = &ikvm->thumb;
+	int rc = resize_thumb(ikvm);
+
+	if (rc)
+		return rc;
+
+	t->server = rfbGetScreen(&argc, argv, t->width, t->height,
+				 BITS_PER_SAMPLE, SAMPLES_PER_PIXEL,
+				 BYTES_PER_PIXEL);
+	if (!t->server) {
+		printf("failed to get thumbnail screen\n");
+		return -ENODEV;
+	}
+
+	t->server->screenData = ikvm;
+	t->server->desktopName = "AST2XXX Video Engine thumbnail";
+	t->server->frameBuffer = t->fb;
+	t->server->alwaysShared = true;
+	t->server->port = t->port;
+	t->server->ipv6port = t->port;
+	t->server->newClientHook = new_thumb_client;
+
+	rfbInitServer(t->server);
+	t->server->serverFormat = ikvm->server->serverFormat;
+
+	return 0;
+}
+
+static void send_frame_to_clients(struct obmc_ikvm *ikvm)
+{
+	if (ikvm->wait_next) {
+		ikvm->wait_next = false;
+
+		/* Wait for the rfb processing thread to finish it's work */
+		pthread_mutex_lock(&mutex);
+		pthread_cond_wait(&cond, &mutex);
+		ikvm->dont_wait = true;
+	}
+
+	rfbClientIteratorPtr iterator = walk_clients(ikvm);
+	rfbClientPtr cl;
+
+	while ((cl = next_client(iterator))) {
+#if 1
+		struct ikvm_client *client = cl->clientData;
+		unsigned long long start_ns;
+		unsigned long long cpu_ns;
+		int rc;
+
+		if (ikvm->refine.state == REFINE_IDLE && client->refined)
+			continue;
+
+		if (!client_ready(cl))
+			continue;
+
+		start_ns = now_ns();
+		client->update_pending = false;
+
+		pthread_mutex_lock(&client->send_lock);
+
+		cpu_ns = thread_cpu_ns();
+
+		if (send_new_fb_size(cl, ikvm))
+			rc = ikvm->backend->send(cl, ikvm);
+		else
+			rc = -1;
+
+		client->stats.cpu_ns += thread_cpu_ns() - cpu_ns;
+
+		if (rc > 0) {
+			client->refined = ikvm->refine.state == REFINE_IDLE;
+			client->stats.frames++;
+			client->stats.bytes += rc;
+			flow_sent(cl, rc);
+		}
+
+		pthread_mutex_unlock(&client->send_lock);
+
+		if (!rc)
+			client->update_pending = true;
+		else if (rc > 0)
+			trace_frame(ikvm, TRACE_SEND, cl->sock, rc, start_ns);
+
+#else
+		rfbFramebufferUpdateMsg *fu =
+			(rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+		fu->type = rfbFramebufferUpdate;
+
+		if (cl->enableLastRectEncoding)
+			fu->nRects = 0xFFFF;
+		else
+			fu->nRects = Swap16IfLE(1);
+
+		cl->ublen = sz_rfbFramebufferUpdateMsg;
+
+		rfbSendUpdateBuf(cl);
+
+		cl->tightEncoding = rfbEncodingTight;
+
+		rfbSendTightHeader(cl, 0, 0, ikvm->resolution.width,
+				   ikvm->resolution.height);
+
+		cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
+
+		rfbSendCompressedDataTight(cl, ikvm->frame, ikvm->frame_size);
+
+		if (cl->enableLastRectEncoding)
+			rfbSendLastRectMarker(cl);
+
+		rfbSendUpdateBuf(cl);
+#endif
+	}
+
+	end_walk(iterator);
+}
+
+/*
+ * While there's no video, clients get the no signal screen from the
+ * framebuffer, once for each time it changes. The video doesn't know what
+ * they were shown, so the next frame each of them gets is a full one.
+ */
+static void send_fb_to_clients(struct obmc_ikvm *ikvm)
+{
+	rfbClientIteratorPtr iterator = walk_clients(ikvm);
+	rfbClientPtr cl;
+
+	while ((cl = next_client(iterator))) {
+		struct ikvm_client *client = cl->clientData;
+		unsigned long long cpu_ns;
+
+		if (client->fb_seq == ikvm->fb_seq || !client_ready(cl))
+			continue;
+
+		client->update_pending = false;
+
+		pthread_mutex_lock(&client->send_lock);
+
+		cpu_ns = thread_cpu_ns();
+
+		if (send_new_fb_size(cl, ikvm) && send_fb(cl, ikvm)) {
+			client->fb_seq = ikvm->fb_seq;
+			client->needs_full = true;
+			client->stats.frames++;
+		}
+
+		client->stats.cpu_ns += thread_cpu_ns() - cpu_ns;
+
+		pthread_mutex_unlock(&client->send_lock);
+	}
+
+	end_walk(iterator);
+}
+
+/* Errors that mean the engine has no usable input rather than a fault */
+static int video_error(int err)
+{
+	switch (err) {
+	case ENOLINK:
+	case ENOLCK:
+	case ETIMEDOUT:
+	case ERANGE:
+		return -ENOLINK;
+	default:
+		return -EIO;
+	}
+}
+
+/*
+ * Track whether the picture is holding still and move between the qualities;
+ * returns false for frames that shouldn't be sent. The first frames after a
+ * quality change may have been compressed before it, so they're skipped.
+ */
+static bool refine_frame(struct obmc_ikvm *ikvm)
+{
+	struct refine *r = &ikvm->refine;
+	unsigned int hash = hash_data(ikvm->frame, ikvm->frame_size);
+	unsigned long long now = now_ns();
+	bool changed = hash != r->hash;
+
+	r->hash = hash;
+	r->refreshed = false;
+
+	switch (r->state) {
+	case REFINE_MOTION:
+		if (changed)
+			r->change_ns = now;
+		else if (now - r->change_ns >= r->static_ms * 1000000ULL &&
+			 !set_quality(ikvm, r->high)) {
+			r->state = REFINE_SETTLE;
+			r->settle = REFINE_SETTLE_FRAMES;
+		}
+		break;
+	case REFINE_SETTLE:
+		if (r->settle--)
+			return false;
+
+		/* This one is the refresh */
+		r->state = REFINE_IDLE;
+		r->refreshed = true;
+		break;
+	case REFINE_IDLE:
+		if (changed && !set_quality(ikvm, r->low)) {
+			r->state = REFINE_MOTION;
+			r->change_ns = now;
+		}
+		break;
+	}
+
+	return true;
+}
+
+/* Whether the frame read at start_ns is the first to show the probe */
+static void latency_frame(struct obmc_ikvm *ikvm, unsigned long long start_ns)
+{
+	struct latency *l = &ikvm->latency;
+	unsigned int hash = hash_data(ikvm->frame, ikvm->frame_size);
+	unsigned long long report_ns;
+	int waiting = LATENCY_WAITING;
+	bool changed;
+
+	if (ikvm->backend == &rects_backend)
+		changed = ikvm->num_changed;
+	else
+		changed = hash != l->hash;
+
+	l->hash = hash;
+
+	/* Only a frame started after the report went out can show it */
+	report_ns = __atomic_load_n(&l->report_ns, __ATOMIC_ACQUIRE);
+	if (!changed || !report_ns || start_ns < report_ns)
+		return;
+
+	if (__atomic_compare_exchange_n(&l->state, &waiting, LATENCY_SENDING,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+		l->capture_ns = now_ns();
+}
+
+static void latency_sent(struct obmc_ikvm *ikvm)
+{
+	struct latency *l = &ikvm->latency;
+	unsigned long long now = now_ns();
+	unsigned int n = l->num;
+
+	if (__atomic_load_n(&l->state, __ATOMIC_ACQUIRE) != LATENCY_SENDING)
+		return;
+
+	l->total[n] = now - l->inject_ns;
+	l->report[n] = l->report_ns - l->inject_ns;
+	l->capture[n] = l->capture_ns - l->report_ns;
+	l->send[n] = now - l->capture_ns;
+	l->num++;
+
+	l->next_ns = now + (LATENCY_INTERVAL_MS * 1000000ULL);
+	__atomic_store_n(&l->state, LATENCY_IDLE, __ATOMIC_RELEASE);
+}
+
+/* Everything after a frame is in the capture buffer, read at start_ns */
+static int process_frame(struct obmc_ikvm *ikvm, unsigned long long start_ns)
+{
+	int rc;
+
+	rc = ikvm->backend->parse(ikvm);
+	if (rc) {
+		printf("failed to parse %s frame: %d; sending frames as is\n",
+		       ikvm->backend->name, rc);
+		ikvm->backend = &opaque_backend;
+		ikvm->backend->parse(ikvm);
+	}
+
+	if (ikvm->latency.probes)
+		latency_frame(ikvm, start_ns);
+
+	if (ikvm->refine.state != REFINE_OFF && !refine_frame(ikvm))
+		return 0;
+
+	send_frame_to_clients(ikvm);
+	ikvm->video_fresh = false;
+
+	if (ikvm->latency.probes)
+		latency_sent(ikvm);
+
+	return 0;
+}
+
+static int change_resolution(struct obmc_ikvm *ikvm, size_t width,
+			     size_t height, size_t frame_size)
+{
+	int rc;
+	char *old_fb = ikvm->fb;
+	size_t old_fb_size = ikvm->fb_size;
+
+	rc = alloc_frame(ikvm, frame_size);
+	if (rc)
+		return rc;
+
+	rc = alloc_fb(ikvm, width, height);
+	if (rc)
+		return rc;
+
+	/* Wait for the rfb processing thread to finish it's work */
+	pthread_mutex_lock(&mutex);
+	pthread_cond_wait(&cond, &mutex);
+	ikvm->dont_wait = true;
+
+	rfbNewFramebuffer(ikvm->server, ikvm->fb, ikvm->resolution.width,
+			  ikvm->resolution.height, BITS_PER_SAMPLE,
+			  SAMPLES_PER_PIXEL, BYTES_PER_PIXEL);
+
+	munmap(old_fb, old_fb_size);
+	ikvm->no_signal_shown = false;
+
+	if (ikvm->thumb.server)
+		resize_thumb(ikvm);
+
+	reset_rect_table(ikvm);
+	ikvm->video_fresh = true;
+
+	/* Get the image on the next iteration */
+	ikvm->wait_next = true;
+	return FRAME_NONE;
+}
+
+/*
+ * Saved frames carry no rect count, but they end where their last rect does,
+ * so count them by walking the headers; -1 if the frame can't be walked.
+ */
+static int playback_rects(struct obmc_ikvm *ikvm)
+{
+	int num = 0;
+	size_t pos = 0;
+	const unsigned char *frame = (const unsigned char *)ikvm->frame;
+
+	while (pos < ikvm->frame_size) {
+		long len;
+		int w;
+		int h;
+		rfbFramebufferUpdateRectHeader hdr;
+
+		if (pos + sz_rfbFramebufferUpdateRectHeader > ikvm->frame_size)
+			return -1;
+
+		memcpy(&hdr, &frame[pos], sz_rfbFramebufferUpdateRectHeader);
+		w = Swap16IfLE(hdr.r.w);
+		h = Swap16IfLE(hdr.r.h);
+		pos += sz_rfbFramebufferUpdateRectHeader;
+
+		if (Swap32IfLE(hdr.encoding) == rfbEncodingHextile)
+			len = hextile_len(&frame[pos], ikvm->frame_size - pos,
+					  w, h);
+		else if (Swap32IfLE(hdr.encoding) == rfbEncodingRaw)
+			len = (long)w * h * BYTES_PER_PIXEL;
+		else
+			len = -1;
+
+		if (len < 0 || pos + len > ikvm->frame_size)
+			return -1;
+
+		pos += len;
+		num++;
+	}
+
+	return num;
+}
+
+static int get_playback_frame(struct obmc_ikvm *ikvm)
+{
+	int fd;
+	int rc;
+	char path[256];
+	struct stat st;
+	struct playback *p = &ikvm->playback;
+	unsigned int reports = __atomic_load_n(&ikvm->reports,
+					       __ATOMIC_ACQUIRE);
+	unsigned long long start_ns = now_ns();
+
+	/*
+	 * Saved frames only fit the mode they were taken in, so the soak test
+	 * has the same mode set again: new buffers, and a resize for viewers.
+	 * alloc_frame only ever grows the capture buffer, so drop it first to
+	 * have it really allocated again at the same size.
+	 */
+	if (__atomic_exchange_n(&p->mode_change, false, __ATOMIC_ACQ_REL)) {
+		size_t size = ikvm->frame_buf_size;
+
+		free(ikvm->frame);
+		ikvm->frame = NULL;
+		ikvm->frame_buf_size = 0;
+		ikvm->frame_size = 0;
+
+		return change_resolution(ikvm, ikvm->resolution.width,
+					 ikvm->resolution.height, size);
+	}
+
+	if (reports != p->reports) {
+		p->reports = reports;
+		p->index = (p->index + 1) % p->num_frames;
+	}
+
+	snprintf(path, sizeof(path), "%s/frame%03u.bin", p->dir, p->index);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("failed to open %s: %d %s\n", path, errno,
+		       strerror(errno));
+		return -EIO;
+	}
+
+	rc = fstat(fd, &st);
+	if (!rc)
+		rc = alloc_frame(ikvm, st.st_size);
+	if (!rc) {
+		rc = read(fd, ikvm->frame, st.st_size);
+		if (rc < 0)
+			printf("failed to read %s: %d %s\n", path, errno,
+			       strerror(errno));
+	}
+
+	close(fd);
+
+	if (rc < 0)
+		return -EIO;
+
+	ikvm->frame_size = rc;
+	ikvm->nRects = playback_rects(ikvm);
+	if (ikvm->nRects <= 0) {
+		printf("failed to find the rects in %s\n", path);
+		return -EIO;
+	}
+
+	return process_frame(ikvm, start_ns);
+}
+
+static int get_frame(struct obmc_ikvm *ikvm)
+{
+	int rc;
+	struct pollfd pfd;
+	struct v4l2_format fmt;
+	unsigned long long start_ns = now_ns();
+
+	ikvm->frame_id++;
+
+	if (ikvm->playback.dir)
+		return get_playback_frame(ikvm);
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
+	if (rc < 0) {
+		printf("failed to query format: %d %s\n", errno,
+		       strerror(errno));
+		return video_error(errno);
+	}
+
+	if (!fmt.fmt.pix.width || !fmt.fmt.pix.height)
+		return -ENOLINK;
+
+	if (fmt.fmt.pix.width != ikvm->resolution.width ||
+	    fmt.fmt.pix.height != ikvm->resolution.height)
+		return change_resolution(ikvm, fmt.fmt.pix.width,
+					 fmt.fmt.pix.height,
+					 fmt_frame_size(&fmt));
+
+	rc = alloc_frame(ikvm, fmt_frame_size(&fmt));
+	if (rc)
+		return rc;
+
+	fmt.type = V4L2_BUF_TYPE_VIDEO_OVERLAY;
+	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
+	if (rc < 0) {
+		printf("failed to query format: %d %s\n", errno,
+			strerror(errno));
+		return video_error(errno);
+	}
+
+	ikvm->nRects = fmt.fmt.win.clipcount;
+	trace_frame(ikvm, TRACE_FMT, -1, ikvm->nRects, start_ns);
+
+	start_ns = now_ns();
+
+	/* Don't block forever in read() if the engine stops producing frames */
+	pfd.fd = ikvm->videodev_fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, VIDEO_TIMEOUT_MS);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0) {
+		printf("failed to poll video device: %d %s\n", errno,
+		       strerror(errno));
+		return video_error(errno);
+	}
+
+	if (rc == 0)
+		return -ENOLINK;
+
+	rc = read(ikvm->videodev_fd, ikvm->frame, ikvm->frame_buf_size);
+	if (rc < 0) {
+		printf("failed to read frame: %d %s\n", errno,
+		       strerror(errno));
+		return video_error(errno);
+	}
+
+	/*
+	 * The read() interface doesn't hand back the driver's buffer timestamp,
+	 * so the end of the read event stands in for the capture time.
+	 */
+	trace_frame(ikvm, TRACE_READ, -1, rc, start_ns);
+
+	if (rc != ikvm->frame_size)
+		DBG("new frame size: %d\n", rc);
+
+	/*
+	 * The frame may not have fit, and a truncated bitstream would throw
+	 * every viewer's decoder off; make room and take the next one instead.
+	 */
+	if (rc == ikvm->frame_buf_size) {
+		printf("frame filled %d byte buffer; dropped\n", rc);
+		alloc_frame(ikvm, ikvm->frame_buf_size * 2);
+		return FRAME_NONE;
+	}
+
+	ikvm->frame_size = rc;
+
+	return process_frame(ikvm, start_ns);
+}
+
+static bool unix_peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		printf("failed to get peer credentials: %d %s\n", errno,
+		       strerror(errno));
+		return false;
+	}
+
+	if (!cred.uid || cred.uid == geteuid() || cred.gid == getegid())
+		return true;
+
+	printf("refusing local client pid %d uid %u gid %u\n", cred.pid,
+	       cred.uid, cred.gid);
+
+	return false;
+}
+
+static int init_events(struct obmc_ikvm *ikvm, const char *path)
+{
+	int rc;
+	struct sockaddr_un addr;
+	struct events *ev = &ikvm->events;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	ev->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+			       SOCK_CLOEXEC, 0);
+	if (ev->listen_fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(ev->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) || listen(ev->listen_fd, EVENTS_MAX_SUBSCRIBERS)) {
+		rc = -errno;
+		close(ev->listen_fd);
+		ev->listen_fd = -1;
+		unlink(path);
+		return rc;
+	}
+
+	ev->path = path;
+	ev->width = ikvm->resolution.width;
+	ev->height = ikvm->resolution.height;
+
+	return 0;
+}
+
+static void close_events(struct events *ev)
+{
+	int i;
+
+	for (i = 0; i < ev->num_subscribers; ++i)
+		close(ev->subscribers[i]);
+
+	ev->num_subscribers = 0;
+
+	if (ev->listen_fd >= 0) {
+		close(ev->listen_fd);
+		unlink(ev->path);
+	}
+
+	ev->listen_fd = -1;
+}
+
+static bool send_event_to(int fd, const char *line)
+{
+	return send(fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT) >= 0;
+}
+
+/* Nobody waiting on an event should miss one, so laggards are dropped */
+static void send_event(struct events *ev, const char *line)
+{
+	int i;
+
+	for (i = ev->num_subscribers - 1; i >= 0; --i) {
+		if (send_event_to(ev->subscribers[i], line))
+			continue;
+
+		close(ev->subscribers[i]);
+		ev->subscribers[i] = ev->subscribers[--ev->num_subscribers];
+	}
+}
+
+/* New subscribers first hear how things stand */
+static void add_events_subscriber(struct obmc_ikvm *ikvm, int fd)
+{
+	char line[64];
+	struct events *ev = &ikvm->events;
+
+	if (ev->num_subscribers == EVENTS_MAX_SUBSCRIBERS) {
+		close(fd);
+		return;
+	}
+
+	snprintf(line, sizeof(line), "resolution %zux%zu\n", ev->width,
+		 ev->height);
+	if (!send_event_to(fd, line) ||
+	    !send_event_to(fd, ev->signal ? "signal\n" : "signal lost\n")) {
+		close(fd);
+		return;
+	}
+
+	if (ev->stable) {
+		snprintf(line, sizeof(line), "stable %u\n", ikvm->frame_id);
+		if (!send_event_to(fd, line)) {
+			close(fd);
+			return;
+		}
+	}
+
+	ev->subscribers[ev->num_subscribers++] = fd;
+}
+
+/* Take in new subscribers and drop those that hung up */
+static void poll_events(struct obmc_ikvm *ikvm)
+{
+	int fd;
+	int i;
+	struct events *ev = &ikvm->events;
+	struct pollfd pfd[EVENTS_MAX_SUBSCRIBERS];
+
+	while ((fd = accept4(ev->listen_fd, NULL, NULL,
+			     SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		if (!unix_peer_allowed(fd)) {
+			close(fd);
+			continue;
+		}
+
+		add_events_subscriber(ikvm, fd);
+	}
+
+	for (i = 0; i < ev->num_subscribers; ++i) {
+		pfd[i].fd = ev->subscribers[i];
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+
+	if (poll(pfd, ev->num_subscribers, 0) <= 0)
+		return;
+
+	for (i = ev->num_subscribers - 1; i >= 0; --i) {
+		if (!pfd[i].revents)
+			continue;
+
+		close(ev->subscribers[i]);
+		ev->subscribers[i] = ev->subscribers[--ev->num_subscribers];
+	}
+}
+
+static void events_signal(struct obmc_ikvm *ikvm, bool signal)
+{
+	struct events *ev = &ikvm->events;
+
+	if (ev->listen_fd < 0 || ev->signal == signal)
+		return;
+
+	ev->signal = signal;
+	__atomic_store_n(&ev->stable, false, __ATOMIC_RELEASE);
+	ev->change_ns = now_ns();
+	send_event(ev, signal ? "signal\n" : "signal lost\n");
+}
+
+/*
+ * A changed frame after the screen was stable is one "changed" event, and
+ * stable_ms without any change after that is one "stable" event, rather
+ * than an event for every frame.
+ */
+static void events_frame(struct obmc_ikvm *ikvm)
+{
+	char line[64];
+	bool changed;
+	struct events *ev = &ikvm->events;
+	unsigned int hash = hash_data(ikvm->frame, ikvm->frame_size);
+	unsigned long long now = now_ns();
+
+	/*
+	 * Frames from around a quality change differ from the last one only
+	 * in how they were compressed; wait for the refresh and start over
+	 * from it.
+	 */
+	if (ikvm->refine.state == REFINE_SETTLE)
+		return;
+
+	if (ikvm->refine.refreshed)
+		changed = false;
+	else if (ikvm->backend == &rects_backend)
+		changed = ikvm->num_changed;
+	else
+		changed = hash != ev->hash;
+
+	ev->hash = hash;
+
+	if (ikvm->resolution.width != ev->width ||
+	    ikvm->resolution.height != ev->height) {
+		ev->width = ikvm->resolution.width;
+		ev->height = ikvm->resolution.height;
+		snprintf(line, sizeof(line), "resolution %zux%zu\n",
+			 ev->width, ev->height);
+		send_event(ev, line);
+		changed = true;
+	}
+
+	if (changed) {
+		ev->change_ns = now;
+		if (!ev->stable)
+			return;
+
+		__atomic_store_n(&ev->stable, false, __ATOMIC_RELEASE);
+		snprintf(line, sizeof(line), "changed %u\n", ikvm->frame_id);
+		send_event(ev, line);
+	} else if (!ev->stable &&
+		   now - __atomic_load_n(&ev->change_ns, __ATOMIC_RELAXED) >=
+		   ev->stable_ms * 1000000ULL) {
+		__atomic_store_n(&ev->stable, true, __ATOMIC_RELEASE);
+		snprintf(line, sizeof(line), "stable %u\n", ikvm->frame_id);
+		send_event(ev, line);
+	}
+}
+
+static void show_no_signal(struct obmc_ikvm *ikvm, bool show)
+{
+	int len = strlen(NO_SIGNAL_TEXT) * 8;
+	int x = (ikvm->resolution.width - len) / 2;
+	int y = ikvm->resolution.height / 2;
+
+	if (ikvm->no_signal_shown == show)
+		return;
+
+	ikvm->no_signal_shown = show;
+	ikvm->fb_seq++;
+
+	if (show)
+		rfbDrawString(ikvm->server, &default8x16Font, x, y,
+			      NO_SIGNAL_TEXT, 0xFFFF);
+	else
+		rfbFillRect(ikvm->server, x, y - 16, x + len, y + 4, 0);
+}
+
+static void close_videodev(struct obmc_ikvm *ikvm)
+{
+	if (ikvm->videodev_fd >= 0) {
+		close(ikvm->videodev_fd);
+		ikvm->videodev_fd = -1;
+	}
+
+	ikvm->video_state = VIDEO_DOWN;
+}
+
+/* Ask the engine whether it sees a signal; assume so if it can't tell */
+static bool video_has_signal(struct obmc_ikvm *ikvm)
+{
+	struct v4l2_input input;
+
+	memset(&input, 0, sizeof(input));
+	if (ioctl(ikvm->videodev_fd, VIDIOC_ENUMINPUT, &input) < 0)
+		return true;
+
+	return !(input.status & (V4L2_IN_ST_NO_POWER | V4L2_IN_ST_NO_SIGNAL |
+				 V4L2_IN_ST_NO_SYNC));
+}
+
+static void video_retry_later(struct obmc_ikvm *ikvm)
+{
+	ikvm->video_retry_ns = now_ns() + (ikvm->video_retry_ms * 1000000ULL);
+
+	ikvm->video_retry_ms *= 2;
+	if (ikvm->video_retry_ms > VIDEO_RETRY_MAX_MS)
+		ikvm->video_retry_ms = VIDEO_RETRY_MAX_MS;
+}
+
+/*
+ * Handle a failed capture: a lost signal keeps the device open and waits for
+ * the signal to come back, while any other error closes the device to be
+ * opened again. Either way clients stay connected, see the no signal frame,
+ * and the device is retried with exponential backoff.
+ */
+static void video_failed(struct obmc_ikvm *ikvm, int rc)
+{
+	if (rc == -ENOLINK) {
+		if (ikvm->video_state == VIDEO_STREAMING)
+			printf("video signal lost\n");
+
+		ikvm->video_state = VIDEO_NO_SIGNAL;
+	} else {
+		printf("video engine error %d; re-opening\n", rc);
+		close_videodev(ikvm);
+	}
+
+	show_no_signal(ikvm, true);
+	video_retry_later(ikvm);
+	events_signal(ikvm, false);
+}
+
+/* Try to get back to streaming once the backoff has expired */
+static void video_recover(struct obmc_ikvm *ikvm)
+{
+	if (now_ns() < ikvm->video_retry_ns)
+		return;
+
+	if (ikvm->video_state == VIDEO_DOWN) {
+		if (init_videodev(ikvm)) {
+			show_no_signal(ikvm, true);
+			video_retry_later(ikvm);
+			return;
+		}
+	} else if (!video_has_signal(ikvm)) {
+		video_retry_later(ikvm);
+		return;
+	}
+
+	ikvm->video_state = VIDEO_STREAMING;
+}
+
+static void video_streaming(struct obmc_ikvm *ikvm)
+{
+	if (ikvm->video_retry_ms != VIDEO_RETRY_MIN_MS) {
+		printf("video resumed\n");
+		ikvm->video_retry_ms = VIDEO_RETRY_MIN_MS;
+	}
+
+	show_no_signal(ikvm, false);
+	events_signal(ikvm, true);
+}
+
+static int timespec_subtract(struct timespec *result, struct timespec *x,
+			     struct timespec *y)
+{
+	/* Perform the carry for the later subtraction by updating y. */
+	if (x->tv_nsec < y->tv_nsec) {
+		long long int nsec =
+			((y->tv_nsec - x->tv_nsec) / 1000000000ULL) + 1;
+
+		y->tv_nsec -= 1000000000ULL * nsec;
+		y->tv_sec += nsec;
+	}
+
+	if (x->tv_nsec - y->tv_nsec > 1000000000ULL) {
+		long long int nsec = (x->tv_nsec - y->tv_nsec) / 1000000000ULL;
+
+		y->tv_nsec += 1000000000ULL * nsec;
+		y->tv_sec -= nsec;
+	}
+
+	/*
+	 * Compute the time remaining to wait.
+	 * tv_nsec is certainly positive.
+	 */
+	result->tv_sec = x->tv_sec - y->tv_sec;
+	result->tv_nsec = x->tv_nsec - y->tv_nsec;
+
+	/* Return 1 if result is negative. */
+	return x->tv_sec < y->tv_sec;
+}
+
+static void dump_frame(struct obmc_ikvm *ikvm)
+{
+	int fd;
+	int rc;
+	char path[256];
+
+	snprintf(path, 256, "%s/frame%03d.bin", DUMP_FRAME_DIR,
+		 ikvm->dump_frame_idx++);
+
+	fd = open(path, O_WRONLY | O_CREAT, 0666);
+	if (fd < 0) {
+		printf("failed to open %s: %d %s\n", path, errno,
+		       strerror(errno));
+		return;
+	}
+
+	rc = write(fd, ikvm->frame, ikvm->frame_size);
+	if (rc < ikvm->frame_size)
+		printf("failed to write frame: %d %s\n", errno,
+		       strerror(errno));
+
+	close(fd);
+}
+
+static struct export_slot *export_slot(struct export_header *header,
+				       unsigned long long seq)
+{
+	return (struct export_slot *)((char *)header + sizeof(*header) +
+				      (seq % header->slots) *
+				      header->slot_size);
+}
+
+/* Make room for frames of len bytes; consumers see size change and remap */
+static int grow_export(struct frame_export *export, size_t len)
+{
+	unsigned int i;
+	size_t slot_size = sizeof(struct export_slot) + len;
+	size_t size;
+	long page = sysconf(_SC_PAGESIZE);
+	struct export_header *header = export->header;
+
+	slot_size = (slot_size + page - 1) & ~(page - 1);
+	size = sizeof(*header) + EXPORT_SLOTS * slot_size;
+
+	if (ftruncate(export->fd, size)) {
+		printf("failed to grow frame export: %d %s\n", errno,
+		       strerror(errno));
+		return -errno;
+	}
+
+	if (header) {
+		__atomic_store_n(&header->seq, 0, __ATOMIC_RELEASE);
+		header = mremap(header, header->size, size, MREMAP_MAYMOVE);
+	} else {
+		header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			      export->fd, 0);
+	}
+
+	if (header == MAP_FAILED) {
+		printf("failed to map frame export: %d %s\n", errno,
+		       strerror(errno));
+		export->header = NULL;
+		return -errno;
+	}
+
+	header->magic = EXPORT_MAGIC;
+	header->version = EXPORT_VERSION;
+	header->slots = EXPORT_SLOTS;
+	header->slot_size = slot_size;
+
+	for (i = 0; i < EXPORT_SLOTS; ++i)
+		export_slot(header, i)->seq = 0;
+
+	__atomic_store_n(&header->size, size, __ATOMIC_RELEASE);
+	export->header = header;
+
+	return 0;
+}
+
+static void close_export(struct frame_export *export)
+{
+	int i;
+
+	for (i = 0; i < export->num_consumers; ++i)
+		close(export->consumers[i]);
+
+	export->num_consumers = 0;
+
+	if (export->listen_fd >= 0)
+		close(export->listen_fd);
+
+	if (export->path)
+		unlink(export->path);
+
+	if (export->ro_fd >= 0)
+		close(export->ro_fd);
+
+	if (export->header)
+		munmap(export->header, export->header->size);
+
+	if (export->fd >= 0)
+		close(export->fd);
+
+	export->fd = -1;
+	export->ro_fd = -1;
+	export->listen_fd = -1;
+	export->path = NULL;
+	export->header = NULL;
+}
+
+/*
+ * Publish frames in a memfd ring that local consumers map read-only, rather
+ * than have each of them open a VNC session. The descriptor is handed out to
+ * whoever connects to a SOCK_SEQPACKET socket at path; keeping that
+ * connection open is what keeps frames coming.
+ */
+static int init_export(struct frame_export *export, const char *path)
+{
+	int rc;
+	char name[32];
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	export->fd = memfd_create("obmc-ikvm-frames",
+				  MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (export->fd < 0)
+		return -errno;
+
+	rc = grow_export(export, DEFAULT_WIDTH * DEFAULT_HEIGHT *
+			 BYTES_PER_PIXEL);
+	if (rc)
+		goto err;
+
+	/*
+	 * Consumers' mappings never lose pages under them, and with only our
+	 * writable mapping left, which mremap() grows, no one else can write:
+	 * not even by opening /proc/<pid>/fd/<n> read-write.
+	 */
+	if (fcntl(export->fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_FUTURE_WRITE)) {
+		rc = -errno;
+		goto err;
+	}
+
+	/* A read-only open of the memfd can't be mapped writable */
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", export->fd);
+	export->ro_fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (export->ro_fd < 0) {
+		rc = -errno;
+		goto err;
+	}
+
+	export->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+				   SOCK_CLOEXEC, 0);
+	if (export->listen_fd < 0) {
+		rc = -errno;
+		goto err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(export->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) ||
+	    listen(export->listen_fd, EXPORT_MAX_CONSUMERS)) {
+		rc = -errno;
+		unlink(path);
+		goto err;
+	}
+
+	export->path = path;
+
+	return 0;
+
+err:
+	close_export(export);
+	return rc;
+}
+
+static void add_export_consumer(struct obmc_ikvm *ikvm, int fd)
+{
+	uint32_t magic = EXPORT_MAGIC;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct frame_export *export = &ikvm->export;
+	struct iovec iov = { .iov_base = &magic, .iov_len = sizeof(magic) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (export->num_consumers == EXPORT_MAX_CONSUMERS) {
+		close(fd);
+		return;
+	}
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &export->ro_fd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		printf("failed to send frame export fd: %d %s\n", errno,
+		       strerror(errno));
+		close(fd);
+		return;
+	}
+
+	export->consumers[export->num_consumers++] = fd;
+
+	/* A rect-list engine needs a restart to send a whole frame again */
+	if (ikvm->backend == &rects_backend)
+		ikvm->reset_video = true;
+}
+
+/* Take in new consumers and drop those that hung up */
+static void poll_export(struct obmc_ikvm *ikvm)
+{
+	int fd;
+	int i;
+	struct frame_export *export = &ikvm->export;
+	struct pollfd pfd[EXPORT_MAX_CONSUMERS];
+
+	while ((fd = accept4(export->listen_fd, NULL, NULL,
+			     SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		if (!unix_peer_allowed(fd)) {
+			close(fd);
+			continue;
+		}
+
+		add_export_consumer(ikvm, fd);
+	}
+
+	for (i = 0; i < export->num_consumers; ++i) {
+		pfd[i].fd = export->consumers[i];
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+
+	if (poll(pfd, export->num_consumers, 0) <= 0)
+		return;
+
+	for (i = export->num_consumers - 1; i >= 0; --i) {
+		if (!pfd[i].revents)
+			continue;
+
+		close(export->consumers[i]);
+		export->consumers[i] =
+			export->consumers[--export->num_consumers];
+	}
+}
+
+static void export_frame(struct obmc_ikvm *ikvm)
+{
+	struct frame_export *export = &ikvm->export;
+	struct export_slot *slot;
+	unsigned long long seq;
+
+	if (!export->header ||
+	    sizeof(*slot) + ikvm->frame_size > export->header->slot_size) {
+		if (grow_export(export, ikvm->frame_buf_size))
+			return;
+	}
+
+	seq = ikvm->frame_id;
+	slot = export_slot(export->header, seq);
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->timestamp_ns = now_ns();
+	slot->width = ikvm->resolution.width;
+	slot->height = ikvm->resolution.height;
+	slot->flags = ikvm->frame_is_full ? EXPORT_FULL : 0;
+	slot->len = ikvm->frame_size;
+	snprintf(slot->backend, sizeof(slot->backend), "%s",
+		 ikvm->backend->name);
+	memcpy(slot + 1, ikvm->frame, ikvm->frame_size);
+
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&export->header->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Split host[:port], with [] around IPv6 addresses */
+static int parse_relay(struct relay *relay, const char *arg)
+{
+	char *colon;
+	char *host = strdup(arg);
+
+	if (!host)
+		return -ENOMEM;
+
+	relay->spec = host;
+	relay->host = host;
+	relay->port = RELAY_DEFAULT_PORT;
+
+	if (*host == '[') {
+		char *end = strchr(host, ']');
+
+		if (!end)
+			return -EINVAL;
+
+		*end = '\0';
+		relay->host = host + 1;
+		colon = end[1] == ':' ? &end[1] : NULL;
+	} else {
+		colon = strrchr(host, ':');
+	}
+
+	if (colon) {
+		*colon = '\0';
+		relay->port = colon + 1;
+	}
+
+	return *relay->host && *relay->port ? 0 : -EINVAL;
+}
+
+static void relay_retry_later(struct relay *relay)
+{
+	relay->retry_ns = now_ns() + relay->retry_ms * 1000000ULL;
+
+	relay->retry_ms *= 2;
+	if (relay->retry_ms > RELAY_RETRY_MAX_MS)
+		relay->retry_ms = RELAY_RETRY_MAX_MS;
+}
+
+/* Name lookups can take as long as DNS likes; not on the rfb thread */
+static void *relay_dns_thread(void *ptr)
+{
+	struct relay *relay = (struct relay *)ptr;
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	relay->dns_rc = getaddrinfo(relay->host, relay->port, &hints,
+				    &relay->res);
+	__atomic_store_n(&relay->dns, RELAY_DNS_DONE, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static int relay_resolve(struct relay *relay)
+{
+	pthread_t thread;
+
+	relay->res = NULL;
+	relay->dns = RELAY_DNS_BUSY;
+
+	if (pthread_create(&thread, NULL, relay_dns_thread, relay)) {
+		relay->dns = RELAY_DNS_IDLE;
+		return -EAGAIN;
+	}
+
+	pthread_detach(thread);
+
+	return 0;
+}
+
+static int relay_connect(struct relay *relay)
+{
+	int fd = -1;
+	int rc = relay->dns_rc;
+	struct addrinfo *ai;
+	struct addrinfo *res = relay->res;
+
+	relay->res = NULL;
+	relay->dns = RELAY_DNS_IDLE;
+
+	if (rc) {
+		printf("failed to resolve relay %s: %s\n", relay->host,
+		       gai_strerror(rc));
+		return -EHOSTUNREACH;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+			    SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen) ||
+		    errno == EINPROGRESS)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		printf("failed to connect to relay %s: %d %s\n", relay->host,
+		       errno, strerror(errno));
+		return -errno;
+	}
+
+	relay->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Keep the relay connection up from the rfb thread, which owns the client
+ * list. The connect doesn't block; once it completes the socket becomes a
+ * regular, reverse, client and goes through the usual handshake.
+ */
+static void poll_relay(struct obmc_ikvm *ikvm)
+{
+	int err;
+	socklen_t len = sizeof(err);
+	struct relay *relay = &ikvm->relay;
+	struct pollfd pfd;
+
+	if (relay->cl)
+		return;
+
+	if (relay->fd < 0) {
+		switch (__atomic_load_n(&relay->dns, __ATOMIC_ACQUIRE)) {
+		case RELAY_DNS_IDLE:
+			if (now_ns() >= relay->retry_ns && relay_resolve(relay))
+				relay_retry_later(relay);
+			break;
+		case RELAY_DNS_DONE:
+			if (relay_connect(relay))
+				relay_retry_later(relay);
+			break;
+		}
+
+		return;
+	}
+
+	pfd.fd = relay->fd;
+	pfd.events = POLLOUT;
+	if (!poll(&pfd, 1, 0))
+		return;
+
+	if (getsockopt(relay->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		printf("failed to connect to relay %s: %d %s\n", relay->host,
+		       err, strerror(err));
+		goto err;
+	}
+
+	relay->cl = rfbNewClient(ikvm->server, relay->fd);
+	if (!relay->cl)
+		goto err;
+
+	relay->cl->reverseConnection = TRUE;
+	relay->fd = -1;
+	relay->retry_ms = RELAY_RETRY_MIN_MS;
+	printf("relaying to %s port %s\n", relay->host, relay->port);
+
+	return;
+
+err:
+	close(relay->fd);
+	relay->fd = -1;
+	relay_retry_later(relay);
+}
+
+/*
+ * rfbProcessEvents() without rfbUpdateClient(): libvncserver reads client
+ * messages, accepts and reaps connections, but every framebuffer update is
+ * sent by the capture loop. Otherwise libvncserver would also encode the
+ * framebuffer for whatever regions it thinks are modified, racing with the
+ * frames sent from the other thread.
+ */
+static void process_events(rfbScreenInfoPtr screen, long usec)
+{
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	rfbClientPtr next;
+
+	rfbCheckFds(screen, usec);
+
+	iterator = rfbGetClientIteratorWithClosed(screen);
+	cl = rfbClientIteratorHead(iterator);
+	while (cl) {
+		next = rfbClientIteratorNext(iterator);
+		if (cl->sock < 0)
+			rfbClientConnectionGone(cl);
+		cl = next;
+	}
+	rfbReleaseClientIterator(iterator);
+}
+
+/*
+ * Local front-ends like the web server's VNC proxy can connect over a unix
+ * socket rather than TCP loopback. Only root, our own user and members of
+ * our group are let in; the socket file is limited the same way, so this is
+ * only a second line for when its permissions are loosened.
+ */
+static int init_unix(struct obmc_ikvm *ikvm, const char *path)
+{
+	int rc;
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	ikvm->unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			       SOCK_CLOEXEC, 0);
+	if (ikvm->unix_fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(ikvm->unix_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) || listen(ikvm->unix_fd, SOMAXCONN)) {
+		rc = -errno;
+		close(ikvm->unix_fd);
+		ikvm->unix_fd = -1;
+		unlink(path);
+		return rc;
+	}
+
+	ikvm->unix_path = path;
+
+	return 0;
+}
+
+/* Hand new local connections to libvncserver like its own listener does */
+static void poll_unix(struct obmc_ikvm *ikvm)
+{
+	int fd;
+
+	while ((fd = accept4(ikvm->unix_fd, NULL, NULL,
+			     SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		if (!unix_peer_allowed(fd)) {
+			close(fd);
+			continue;
+		}
+
+		/* On refusal libvncserver closes the socket itself */
+		rfbNewClient(ikvm->server, fd);
+	}
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sort the samples and print percentiles of them, in microseconds */
+static void print_percentiles(const char *name, unsigned long long *ns,
+			      unsigned int num)
+{
+	if (!num) {
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	qsort(ns, num, sizeof(*ns), cmp_ull);
+
+	printf("%s (us): p50 %llu p90 %llu p99 %llu max %llu samples %u\n",
+	       name, ns[num / 2] / 1000, ns[(num * 9) / 10] / 1000,
+	       ns[(num * 99) / 100] / 1000, ns[num - 1] / 1000, num);
+}
+
+static int init_latency(struct obmc_ikvm *ikvm)
+{
+	struct latency *l = &ikvm->latency;
+
+	if (ikvm->input_fd < 0 &&
+	    (l->keysym ? ikvm->keyboard_fd : ikvm->ptr_fd) < 0) {
+		printf("latency test needs a %s gadget\n",
+		       l->keysym ? "keyboard" : "pointer");
+		return -ENODEV;
+	}
+
+	l->total = calloc(l->probes * 4, sizeof(*l->total));
+	l->cl = calloc(1, sizeof(*l->cl));
+	if (!l->total || !l->cl)
+		return -ENOMEM;
+
+	l->report = &l->total[l->probes];
+	l->capture = &l->report[l->probes];
+	l->send = &l->capture[l->probes];
+	l->cl->screen = ikvm->server;
+	l->next_ns = now_ns() + (LATENCY_INTERVAL_MS * 1000000ULL);
+
+	return 0;
+}
+
+static void print_latency(struct obmc_ikvm *ikvm)
+{
+	struct latency *l = &ikvm->latency;
+
+	printf("latency probes %u, no change seen for %u\n", l->num,
+	       l->lost);
+	print_percentiles("input to frame sent", l->total, l->num);
+	print_percentiles("input to report", l->report, l->num);
+	print_percentiles("report to changed frame", l->capture, l->num);
+	print_percentiles("changed frame to sent", l->send, l->num);
+}
+
+/*
+ * Run by the rfb thread ahead of writing reports, so a probe goes through
+ * the handlers and report writers just as a client's event would. Probes
+ * alternate between two pointer positions, or press and release a key,
+ * and stop the daemon when they're all done.
+ */
+static void latency_probe(struct obmc_ikvm *ikvm)
+{
+	int waiting = LATENCY_WAITING;
+	unsigned long long now = now_ns();
+	struct latency *l = &ikvm->latency;
+
+	if (l->key_down && l->report_ns) {
+		key_event(FALSE, l->keysym, l->cl);
+		l->key_down = false;
+	}
+
+	if (now - l->inject_ns > LATENCY_TIMEOUT_MS * 1000000ULL &&
+	    __atomic_compare_exchange_n(&l->state, &waiting, LATENCY_IDLE,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE)) {
+		l->lost++;
+		l->next_ns = now;
+	}
+
+	if (__atomic_load_n(&l->state, __ATOMIC_ACQUIRE) != LATENCY_IDLE ||
+	    now < l->next_ns || l->key_down)
+		return;
+
+	if (l->num + l->lost == l->probes) {
+		print_latency(ikvm);
+		l->probes = 0;
+		ok = false;
+		return;
+	}
+
+	__atomic_store_n(&l->report_ns, 0, __ATOMIC_RELEASE);
+	l->inject_ns = now;
+	l->flip = !l->flip;
+
+	if (l->keysym) {
+		key_event(TRUE, l->keysym, l->cl);
+		l->key_down = true;
+	} else {
+		ptr_event(0, ikvm->resolution.width / (l->flip ? 4 : 2),
+			  ikvm->resolution.height / 2, l->cl);
+	}
+
+	__atomic_store_n(&l->state, LATENCY_WAITING, __ATOMIC_RELEASE);
+}
+
+static const struct {
+	const char *name;
+	rfbKeySym keysym;
+} macro_names[] = {
+	{ "Alt", XK_Alt_L },
+	{ "BackSpace", XK_BackSpace },
+	{ "Ctrl", XK_Control_L },
+	{ "Delete", XK_Delete },
+	{ "Down", XK_Down },
+	{ "End", XK_End },
+	{ "Escape", XK_Escape },
+	{ "Home", XK_Home },
+	{ "Insert", XK_Insert },
+	{ "Left", XK_Left },
+	{ "Page_Down", XK_Page_Down },
+	{ "Page_Up", XK_Page_Up },
+	{ "Return", XK_Return },
+	{ "Right", XK_Right },
+	{ "Shift", XK_Shift_L },
+	{ "space", XK_space },
+	{ "Tab", XK_Tab },
+	{ "Up", XK_Up },
+};
+
+/* A key is a name above, F1 to F24, a single character or a keysym number */
+static rfbKeySym macro_keysym(const char *name)
+{
+	unsigned int i;
+	unsigned long n;
+	char *end;
+
+	for (i = 0; i < sizeof(macro_names) / sizeof(macro_names[0]); ++i)
+		if (!strcmp(name, macro_names[i].name))
+			return macro_names[i].keysym;
+
+	if (name[0] == 'F' && name[1]) {
+		n = strtoul(&name[1], &end, 10);
+		if (!*end && n >= 1 && n <= 24)
+			return XK_F1 + n - 1;
+	}
+
+	if (name[0] && !name[1])
+		return (unsigned char)name[0];
+
+	n = strtoul(name, &end, 0);
+	if (*end)
+		return 0;
+
+	return n;
+}
+
+/* Key names joined by + are pressed together, like Ctrl+Alt+Delete */
+static int parse_macro_key(struct macro_key *k, char *arg)
+{
+	char *save;
+	char *name;
+
+	k->num = 0;
+	for (name = strtok_r(arg, "+", &save); name;
+	     name = strtok_r(NULL, "+", &save)) {
+		if (k->num == MACRO_MAX_CHORD)
+			return -E2BIG;
+
+		k->keysyms[k->num] = macro_keysym(name);
+		if (!keysym_to_entry(k->keysyms[k->num]))
+			return -EINVAL;
+
+		k->num++;
+	}
+
+	return k->num ? 0 : -EINVAL;
+}
+
+/*
+ * A command is "[stable] keys KEY... [every ms] [for ms]", or "stop". The
+ * keys are typed once, or repeated every ms (back to back if not given)
+ * for ms; with stable, not before the screen has held still.
+ */
+static int parse_macro(struct macro *m, char *cmd)
+{
+	int rc;
+	char *save;
+	char *tok = strtok_r(cmd, " \t\n", &save);
+	unsigned long long seq_ns;
+
+	m->every_ns = 0;
+	m->duration_ns = 0;
+	m->num_keys = 0;
+	m->state = MACRO_RUNNING;
+
+	if (tok && !strcmp(tok, "stable")) {
+		m->state = MACRO_WAITING;
+		tok = strtok_r(NULL, " \t\n", &save);
+	}
+
+	if (!tok || strcmp(tok, "keys"))
+		return -EINVAL;
+
+	while ((tok = strtok_r(NULL, " \t\n", &save))) {
+		if (!strcmp(tok, "every") || !strcmp(tok, "for")) {
+			bool every = tok[0] == 'e';
+
+			tok = strtok_r(NULL, " \t\n", &save);
+			if (!tok || !m->num_keys)
+				return -EINVAL;
+
+			if (every)
+				m->every_ns = strtoull(tok, NULL, 0) *
+					1000000ULL;
+			else
+				m->duration_ns = strtoull(tok, NULL, 0) *
+					1000000ULL;
+			continue;
+		}
+
+		if (m->every_ns || m->duration_ns)
+			return -EINVAL;
+
+		if (m->num_keys == MACRO_MAX_KEYS)
+			return -E2BIG;
+
+		rc = parse_macro_key(&m->keys[m->num_keys], tok);
+		if (rc)
+			return rc;
+
+		m->num_keys++;
+	}
+
+	if (!m->num_keys || (m->every_ns && !m->duration_ns))
+		return -EINVAL;
+
+	seq_ns = m->num_keys * (MACRO_HOLD_MS + MACRO_GAP_MS) * 1000000ULL;
+	if (m->every_ns < seq_ns)
+		m->every_ns = seq_ns;
+
+	return 0;
+}
+
+static void macro_reply(int fd, const char *line)
+{
+	if (fd >= 0)
+		send(fd, line, strlen(line), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* Straight to the gadget, rather than waiting on the rfb thread's loop */
+static void macro_press(struct obmc_ikvm *ikvm, struct macro_key *k,
+			bool down)
+{
+	unsigned int i;
+	const struct keymap_entry *e;
+
+	pthread_mutex_lock(&input_mutex);
+
+	for (i = 0; i < k->num; ++i) {
+		e = keysym_to_entry(k->keysyms[down ? i : k->num - 1 - i]);
+		usage_event(ikvm, down, e->usage, e->shift);
+	}
+
+	pthread_mutex_unlock(&input_mutex);
+
+	keyboard_send_report(ikvm);
+}
+
+static void macro_begin(struct macro *m, unsigned long long now)
+{
+	m->state = MACRO_RUNNING;
+	m->step = 0;
+	m->start_ns = now;
+	m->end_ns = now + (m->duration_ns ? m->duration_ns : 1);
+}
+
+static void macro_end(struct obmc_ikvm *ikvm, const char *reply)
+{
+	struct macro *m = &ikvm->macro;
+
+	if (m->pressed) {
+		macro_press(ikvm, &m->keys[m->step / 2], false);
+		m->pressed = false;
+	}
+
+	__atomic_store_n(&m->state, MACRO_IDLE, __ATOMIC_RELEASE);
+	macro_reply(m->owner, reply);
+	m->owner = -1;
+}
+
+/* When the step due next is, counted from the start of its sequence */
+static unsigned long long macro_step_ns(struct macro *m)
+{
+	unsigned long long ns = (m->step / 2) *
+		(MACRO_HOLD_MS + MACRO_GAP_MS) * 1000000ULL;
+
+	if (m->step & 1)
+		ns += MACRO_HOLD_MS * 1000000ULL;
+
+	return m->start_ns + ns;
+}
+
+/* Do whatever steps are due; returns when the next one is */
+static unsigned long long macro_run(struct obmc_ikvm *ikvm,
+				    unsigned long long now)
+{
+	unsigned long long due;
+	struct macro *m = &ikvm->macro;
+
+	while ((due = macro_step_ns(m)) <= now) {
+		m->pressed = !(m->step & 1);
+		macro_press(ikvm, &m->keys[m->step / 2], m->pressed);
+
+		if (++m->step < m->num_keys * 2)
+			continue;
+
+		m->step = 0;
+		m->start_ns += m->every_ns;
+		if (m->start_ns >= m->end_ns) {
+			macro_end(ikvm, "done\n");
+			return 0;
+		}
+	}
+
+	return due;
+}
+
+static void macro_command(struct obmc_ikvm *ikvm, int fd, char *cmd)
+{
+	int rc;
+	struct macro *m = &ikvm->macro;
+	struct macro next;
+
+	cmd += strspn(cmd, " \t\n");
+	if (!strncmp(cmd, "stop", 4)) {
+		if (m->state != MACRO_IDLE)
+			macro_end(ikvm, "stopped\n");
+
+		macro_reply(fd, "ok\n");
+		return;
+	}
 
+	rc = parse_macro(&next, cmd);
+	if (rc) {
+		macro_reply(fd, "error\n");
 		return;
 	}
 
-update_send_report:
-	ikvm->send_report = true;
+	/* A new macro takes over from the one going on */
+	if (m->state != MACRO_IDLE)
+		macro_end(ikvm, "stopped\n");
+
+	m->num_keys = next.num_keys;
+	memcpy(m->keys, next.keys, sizeof(m->keys));
+	m->every_ns = next.every_ns;
+	m->duration_ns = next.duration_ns;
+	m->owner = fd;
+	macro_reply(fd, "ok\n");
+
+	if (next.state == MACRO_WAITING) {
+		/*
+		 * Whatever was stable before the command may not be now; have
+		 * the capture loop see stable_ms of a still screen again.
+		 */
+		__atomic_store_n(&ikvm->events.change_ns, now_ns(),
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&ikvm->events.stable, false,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&m->state, MACRO_WAITING, __ATOMIC_RELEASE);
+	} else {
+		macro_begin(m, now_ns());
+	}
 }
 
-static void init_keyboard(struct obmc_ikvm *ikvm)
+static void macro_poll_controllers(struct obmc_ikvm *ikvm,
+				   struct pollfd *pfd)
 {
-	ikvm->keyboard_fd = open(ikvm->keyboard_name, O_RDWR);
-	if (ikvm->keyboard_fd < 0) {
-		printf("failed to open %s: %d %s\n", ikvm->keyboard_name,
-		       errno, strerror(errno));
+	int i;
+	int fd;
+	ssize_t len;
+	char cmd[512];
+	struct macro *m = &ikvm->macro;
+
+	for (i = m->num_controllers - 1; i >= 0; --i) {
+		if (!pfd[i + 1].revents)
+			continue;
+
+		len = recv(m->controllers[i], cmd, sizeof(cmd) - 1,
+			   MSG_DONTWAIT);
+		if (len > 0) {
+			cmd[len] = '\0';
+			macro_command(ikvm, m->controllers[i], cmd);
+			continue;
+		}
+
+		if (len < 0 && errno == EAGAIN)
+			continue;
+
+		/* A macro goes on without whoever started it */
+		if (m->owner == m->controllers[i])
+			m->owner = -1;
+
+		close(m->controllers[i]);
+		m->controllers[i] = m->controllers[--m->num_controllers];
+	}
+
+	if (!pfd[0].revents)
 		return;
+
+	while ((fd = accept4(m->listen_fd, NULL, NULL,
+			     SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+		if (m->num_controllers == MACRO_MAX_CONTROLLERS ||
+		    !unix_peer_allowed(fd))
+			close(fd);
+		else
+			m->controllers[m->num_controllers++] = fd;
 	}
+}
 
-	ikvm->server->kbdAddEvent = key_event;
+/* The capture loop keeps frames coming for the stable check */
+static bool macro_waiting(struct obmc_ikvm *ikvm)
+{
+	return __atomic_load_n(&ikvm->macro.state, __ATOMIC_ACQUIRE) ==
+		MACRO_WAITING;
 }
 
-static void keyboard_send_report(struct obmc_ikvm *ikvm)
+static void *macro_thread(void *ptr)
 {
-	if (ikvm->send_report) {
-		int fd;
-		char rpt[REPORT_SIZE];
-		unsigned char *data;
+	int i;
+	struct timespec timeout;
+	unsigned long long now;
+	unsigned long long wait_ns;
+	struct obmc_ikvm *ikvm = (struct obmc_ikvm *)ptr;
+	struct macro *m = &ikvm->macro;
+	struct pollfd pfd[MACRO_MAX_CONTROLLERS + 1];
 
-		if (ikvm->input_fd >= 0) {
-			fd = ikvm->input_fd;
+	while (ok) {
+		now = now_ns();
+		wait_ns = MACRO_POLL_MS * 1000000ULL;
 
-			rpt[0] = 1;
-			memcpy(&rpt[1], ikvm->report, ikvm->report_size);
+		if (m->state == MACRO_WAITING &&
+		    __atomic_load_n(&ikvm->events.stable, __ATOMIC_ACQUIRE))
+			macro_begin(m, now);
 
-			data = rpt;
-		} else {
-			fd = ikvm->keyboard_fd;
+		if (m->state == MACRO_RUNNING) {
+			unsigned long long due = macro_run(ikvm, now);
 
-			data = ikvm->report;
+			if (due)
+				wait_ns = due - now;
 		}
 
-		DBG("sending kbd report[%02x%02x%02x%02x%02x%02x%02x%02x]\n",
-		    data[0], data[1], data[2], data[3], data[4], data[5],
-		    data[6], data[7]);
-		if (write(fd, data, REPORT_SIZE) != REPORT_SIZE)
-			printf("failed to write keyboard report: %d %s\n",
-			       errno, strerror(errno));
+		pfd[0].fd = m->listen_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		for (i = 0; i < m->num_controllers; ++i) {
+			pfd[i + 1].fd = m->controllers[i];
+			pfd[i + 1].events = POLLIN;
+			pfd[i + 1].revents = 0;
+		}
 
-		ikvm->send_report = false;
+		timeout.tv_sec = wait_ns / 1000000000ULL;
+		timeout.tv_nsec = wait_ns % 1000000000ULL;
+		if (ppoll(pfd, m->num_controllers + 1, &timeout, NULL) > 0)
+			macro_poll_controllers(ikvm, pfd);
 	}
-}
-
-static void ptr_event(int button_mask, int x, int y, rfbClientPtr cl)
-{
-	struct obmc_ikvm *ikvm = cl->screen->screenData;
 
-	DBG("ptr event btn[%x] x[%d] y[%d]\n", button_mask, x, y);
+	if (m->state != MACRO_IDLE)
+		macro_end(ikvm, "stopped\n");
 
-	ikvm->ptr[0] = button_mask & 0xFF;
+	return NULL;
+}
 
-	if (x >= 0 && x < ikvm->resolution.width) {
-		short xx = x * (0x8000 / ikvm->resolution.width);
+static int init_macro(struct obmc_ikvm *ikvm, const char *path)
+{
+	int rc;
+	struct sockaddr_un addr;
+	struct macro *m = &ikvm->macro;
 
-		memcpy(&ikvm->ptr[1], &xx, 2);
+	if (ikvm->input_fd < 0 && ikvm->keyboard_fd < 0) {
+		printf("macros need a keyboard\n");
+		return -ENODEV;
 	}
 
-	if (y >= 0 && y < ikvm->resolution.height) {
-		short yy = y * (0x8000 / ikvm->resolution.height);
-
-		memcpy(&ikvm->ptr[3], &yy, 2);
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	m->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+			      SOCK_CLOEXEC, 0);
+	if (m->listen_fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(m->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) || listen(m->listen_fd, MACRO_MAX_CONTROLLERS)) {
+		rc = -errno;
+		close(m->listen_fd);
+		m->listen_fd = -1;
+		unlink(path);
+		return rc;
 	}
 
-	ikvm->send_ptr = true;
+	m->path = path;
+	m->owner = -1;
 
-	rfbDefaultPtrAddEvent(button_mask, x, y, cl);
+	return 0;
 }
 
-static void init_ptr(struct obmc_ikvm *ikvm)
+static void close_macro(struct macro *m)
 {
-	ikvm->ptr_fd = open(ikvm->ptr_name, O_RDWR);
-	if (ikvm->ptr_fd < 0) {
-		printf("failed to open %s: %d %s\n", ikvm->ptr_name, errno,
-		       strerror(errno));
-		return;
+	int i;
+
+	for (i = 0; i < m->num_controllers; ++i)
+		close(m->controllers[i]);
+
+	m->num_controllers = 0;
+
+	if (m->listen_fd >= 0) {
+		close(m->listen_fd);
+		unlink(m->path);
 	}
 
-	ikvm->server->ptrAddEvent = ptr_event;
+	m->listen_fd = -1;
 }
 
-static void ptr_send_report(struct obmc_ikvm *ikvm)
+void *threaded_process_rfb(void *ptr)
 {
-	if (ikvm->send_ptr) {
-		int fd;
-		char rpt[PTR_SIZE + 1];
-		size_t rs;
-		unsigned char *data;
+	struct timespec diff;
+	struct timespec end;
+	struct timespec start;
+	struct obmc_ikvm *ikvm = (struct obmc_ikvm *)ptr;
 
-		if (ikvm->input_fd >= 0) {
-			fd = ikvm->input_fd;
-			rs = PTR_SIZE + 1;
+	apply_sched(ikvm, SCHED_ROLE_RFB);
 
-			rpt[0] = 2;
-			memcpy(&rpt[1], ikvm->ptr, PTR_SIZE);
+	while (ok) {
+		if (ikvm->relay.host)
+			poll_relay(ikvm);
 
-			data = rpt;
+		if (ikvm->unix_fd >= 0)
+			poll_unix(ikvm);
 
-			DBG("sending ptr report[%02x%02x%02x%02x%02x%02x]\n",
-			    data[0], data[1], data[2], data[3], data[4],
-			    data[5]);
-		} else {
-			fd = ikvm->ptr_fd;
-			rs = PTR_SIZE;
+		poll_tls(ikvm);
 
-			data = ikvm->ptr;
+		process_events(ikvm->server, ptr_wait_us(ikvm));
 
-			DBG("sending ptr report[%02x%02x%02x%02x%02x]\n",
-			    data[0], data[1], data[2], data[3], data[4]);
-		}
+		/* Thumbnails are real pixels; libvncserver encodes those itself */
+		if (ikvm->thumb.server)
+			rfbProcessEvents(ikvm->thumb.server, 0);
+		jitter_sample(&ikvm->jitter[SCHED_ROLE_RFB]);
+#ifdef _PROFILE_
+		clock_gettime(CLOCK_MONOTONIC, &start);
+#endif /* _PROFILE_ */
+		if (ikvm->latency.probes)
+			latency_probe(ikvm);
 
-		if (write(fd, data, rs) != rs)
-			printf("failed to write ptr report: %d %s\n", errno,
-			       strerror(errno));
+		if ((ikvm->server->clientHead != NULL || ikvm->latency.cl) &&
+		    ok) {
+			keyboard_send_report(ikvm);
+			ptr_send_report(ikvm);
+		}
+#ifdef _PROFILE_
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		timespec_subtract(&diff, &end, &start);
+		_prof(&diff, &_input);
+		DBG("input: %lld.%.9ld\n", (long long)diff.tv_sec,
+		    diff.tv_nsec);
+#endif /* _PROFILE_ */
 
-		ikvm->send_ptr = false;
+		pthread_mutex_lock(&mutex);
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&mutex);
 	}
+
+	return NULL;
 }
 
-static void init_input(struct obmc_ikvm *ikvm)
+struct bench_event {
+	char type;
+	int a;
+	int b;
+	int c;
+	unsigned long long time_us;
+	unsigned long long sent_ns;
+	unsigned int report_idx;
+};
+
+struct bench_report {
+	unsigned char data[REPORT_SIZE];
+	unsigned long long time_ns;
+};
+
+struct bench_gadget {
+	int fd;
+	unsigned int num_kbd;
+	unsigned int num_ptr;
+	struct bench_report *kbd;
+	struct bench_report *ptr;
+};
+
+/* Mock gadget: timestamp every report the daemon writes */
+static void *bench_gadget_thread(void *ptr)
 {
-	ikvm->input_fd = open(ikvm->input_name, O_RDWR);
-	if (ikvm->input_fd < 0) {
-		printf("failed to open %s: %d %s\n", ikvm->input_name, errno,
-		       strerror(errno));
-		return;
+	int rc;
+	unsigned char buf[REPORT_SIZE + 1];
+	struct bench_gadget *g = (struct bench_gadget *)ptr;
+
+	while ((rc = read(g->fd, buf, sizeof(buf))) > 0) {
+		struct bench_report *r;
+
+		if (buf[0] == 1)
+			r = &g->kbd[g->num_kbd++];
+		else
+			r = &g->ptr[g->num_ptr++];
+
+		r->time_ns = now_ns();
+		memcpy(r->data, &buf[1], rc - 1);
 	}
 
-	ikvm->server->kbdAddEvent = key_event;
-	ikvm->server->ptrAddEvent = ptr_event;
-	ikvm->report_size = REPORT_SIZE - 1;
+	return NULL;
 }
 
-static void client_gone(rfbClientPtr cl)
+static struct bench_event *bench_load(struct obmc_ikvm *ikvm, const char *path,
+				      unsigned int *num)
 {
-	struct obmc_ikvm *ikvm = cl->clientData;
+	FILE *f;
+	char line[128];
+	unsigned int size = 0;
+	struct bench_event *events = NULL;
 
-	if (ikvm->num_clients-- > 1)
-		return;
+	f = fopen(path, "r");
+	if (!f) {
+		printf("failed to open %s: %d %s\n", path, errno,
+		       strerror(errno));
+		return NULL;
+	}
 
-	if (ikvm->videodev_fd >= 0) {
-		printf("close(ikvm->videodev_fd)\n");
-		close(ikvm->videodev_fd);
-		ikvm->videodev_fd = open(ikvm->videodev_name, O_RDWR);
-		printf("open(ikvm->videodev_fd)\n");
-		if (ikvm->videodev_fd < 0) {
-			printf("failed to re-open %s: %d %s\n",
-			       ikvm->videodev_name, errno, strerror(errno));
-			ok = false;
-		} else {
-			set_frame_rate(ikvm);
+	*num = 0;
+	while (fgets(line, sizeof(line), f)) {
+		struct bench_event *ev;
+		int w;
+		int h;
 
-			memset(ikvm->frame, 0, ikvm->frame_buf_size);
-			rfbMarkRectAsModified(ikvm->server, 0, 0,
-					      ikvm->resolution.width,
-					      ikvm->resolution.height);
+		if (sscanf(line, "r %d %d", &w, &h) == 2 && w > 0 && h > 0) {
+			ikvm->resolution.width = w;
+			ikvm->resolution.height = h;
+			continue;
 		}
-	}
-}
 
-static enum rfbNewClientAction new_client(rfbClientPtr cl)
-{
-	struct obmc_ikvm *ikvm = cl->screen->screenData;
+		if (*num == size) {
+			size = size ? size * 2 : 1024;
+			ev = realloc(events, size * sizeof(*events));
+			if (!ev) {
+				printf("failed to allocate events\n");
+				free(events);
+				events = NULL;
+				break;
+			}
 
-	cl->clientData = ikvm;
-	cl->clientGoneHook = client_gone;
+			events = ev;
+		}
 
-	ikvm->num_clients++;
-	ikvm->delay_count = ikvm->frame_rate;
+		ev = &events[*num];
+		memset(ev, 0, sizeof(*ev));
+		if (sscanf(line, "%llu %c %d %d %d", &ev->time_us, &ev->type,
+			   &ev->a, &ev->b, &ev->c) >= 4 &&
+		    (ev->type == 'k' || ev->type == 'p'))
+			(*num)++;
+	}
 
-	return RFB_CLIENT_ACCEPT;
+	fclose(f);
+	return events;
 }
 
-static int init_server(struct obmc_ikvm *ikvm, int *argc, char **argv)
+/*
+ * Replay a recorded stream of RFB key and pointer events through the same
+ * event handlers and report writers the rfb thread uses, against a mock
+ * gadget on a socket pair, and report how the input path performed. Events
+ * due at the same time are handled as one batch, like rfbProcessEvents()
+ * draining a client socket, before the reports are written.
+ */
+static int bench_input(struct obmc_ikvm *ikvm, const char *path, int *argc,
+		       char **argv)
 {
-	rfbPixelFormat *format;
+	int rc;
+	int sv[2];
+	unsigned int i;
+	unsigned int j;
+	unsigned int num;
+	unsigned int num_kbd = 0;
+	unsigned int num_ptr = 0;
+	unsigned int num_lat = 0;
+	unsigned int lost = 0;
+	unsigned int merged_kbd = 0;
+	unsigned int merged_ptr = 0;
+	unsigned long long start_ns;
+	unsigned long long elapsed_ns;
+	unsigned long long *lat;
+	struct bench_event *events;
+	struct bench_gadget gadget;
+	rfbClientPtr cl;
+	pthread_t thread;
+
+	ikvm->resolution.width = DEFAULT_WIDTH;
+	ikvm->resolution.height = DEFAULT_HEIGHT;
+
+	events = bench_load(ikvm, path, &num);
+	if (!events)
+		return -EINVAL;
+
+	memset(&gadget, 0, sizeof(gadget));
+	gadget.kbd = calloc(num, sizeof(struct bench_report));
+	gadget.ptr = calloc(num, sizeof(struct bench_report));
+	lat = calloc(num, sizeof(*lat));
+	cl = calloc(1, sizeof(*cl));
+	if (!gadget.kbd || !gadget.ptr || !lat || !cl) {
+		printf("failed to allocate benchmark buffers\n");
+		rc = -ENOMEM;
+		goto done;
+	}
 
 	ikvm->server = rfbGetScreen(argc, argv, ikvm->resolution.width,
 				    ikvm->resolution.height, BITS_PER_SAMPLE,
 				    SAMPLES_PER_PIXEL, BYTES_PER_PIXEL);
 	if (!ikvm->server) {
 		printf("failed to get vnc screen\n");
-		return -ENODEV;
+		rc = -ENODEV;
+		goto done;
 	}
 
 	ikvm->server->screenData = ikvm;
-	ikvm->server->desktopName = "AST2XXX Video Engine";
-	ikvm->server->frameBuffer = ikvm->frame;
-	ikvm->server->alwaysShared = true;
-	ikvm->server->newClientHook = new_client;
+	cl->screen = ikvm->server;
 
-	rfbInitServer(ikvm->server);
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		printf("failed to create mock gadget: %d %s\n", errno,
+		       strerror(errno));
+		rc = -errno;
+		goto done;
+	}
 
-	format = &ikvm->server->serverFormat;
-	format->redMax = 31;
-	format->greenMax = 63;
-	format->blueMax = 31;
-	format->redShift = 11;
-	format->greenShift = 5;
-	format->blueShift = 0;
+	ikvm->input_fd = sv[0];
+	ikvm->report_size = REPORT_SIZE - 1;
+	gadget.fd = sv[1];
+	pthread_create(&thread, NULL, bench_gadget_thread, &gadget);
+
+	start_ns = now_ns();
+	for (i = 0; i < num && ok; i = j) {
+		unsigned long long now;
+		unsigned long long due_ns = start_ns +
+			(events[i].time_us * 1000ULL);
+		struct timespec due;
+
+		/* A held pointer report may fall due before the next event */
+		if (ikvm->send_ptr && ptr_due_ns(ikvm) < due_ns)
+			due_ns = ptr_due_ns(ikvm);
+
+		due.tv_sec = due_ns / 1000000000ULL;
+		due.tv_nsec = due_ns % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+
+		now = now_ns();
+		for (j = i; j < num && start_ns + (events[j].time_us * 1000ULL) <=
+		     now; ++j) {
+			struct bench_event *ev = &events[j];
+
+			ev->sent_ns = now_ns();
+			if (ev->type == 'k') {
+				key_event(ev->a, ev->b, cl);
+				if (ikvm->send_report) {
+					ev->report_idx = num_kbd + 1;
+					merged_kbd++;
+				}
+			} else {
+				ptr_event(ev->a, ev->b, ev->c, cl);
+				ev->report_idx = ikvm->ptr_reports + 1;
+				merged_ptr++;
+			}
+		}
 
-	rfbMarkRectAsModified(ikvm->server, 0, 0, ikvm->resolution.width,
-			      ikvm->resolution.height);
+		if (ikvm->send_report) {
+			num_kbd++;
+			merged_kbd--;
+		}
 
-	return 0;
-}
+		keyboard_send_report(ikvm);
+		ptr_send_report(ikvm);
+	}
 
-static rfbBool
-rfbHextile16(rfbClientPtr cl, struct obmc_ikvm *ikvm) {
-	struct v4l2_format fmt;
-	int err = 0;
-	uint32_t padding_len = 0;
-	uint32_t copy_len = 0;
-	char *copy_addr = ikvm->frame;
-	rfbFramebufferUpdateRectHeader rect;
-	rfbFramebufferUpdateMsg *fu =
-		(rfbFramebufferUpdateMsg *)cl->updateBuf;
+	if (ikvm->send_ptr)
+		ptr_write_report(ikvm);
 
-	if (ikvm->frame_size == 0)
-		return TRUE;
+	num_ptr = ikvm->ptr_reports;
+	merged_ptr -= num_ptr;
 
-	fu->type = rfbFramebufferUpdate;
+	elapsed_ns = now_ns() - start_ns;
 
-	if (cl->enableLastRectEncoding)
-		fu->nRects = 0xFFFF;
-	else
-		fu->nRects = Swap16IfLE(ikvm->nRects);
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(thread, NULL);
+	close(sv[1]);
 
-	cl->ublen = sz_rfbFramebufferUpdateMsg;
+	for (i = 0; i < num; ++i) {
+		struct bench_event *ev = &events[i];
+		struct bench_report *r = NULL;
+		unsigned char sc = 0;
+		unsigned int n;
 
-	rfbSendUpdateBuf(cl);
+		if (ev->type == 'k') {
+			if (ev->a)
+				sc = keysym_to_usage(ev->b);
 
-	if (ikvm->frame_size >= (UPDATE_BUF_SIZE - cl->ublen)) {
-		padding_len = ikvm->frame_size - (UPDATE_BUF_SIZE - cl->ublen);
-		memcpy(&cl->updateBuf[cl->ublen], copy_addr, (UPDATE_BUF_SIZE - cl->ublen));
+			/* Modifiers go in the modifier byte, not a key slot */
+			if (sc >= USBHID_KEY_LEFTCTRL)
+				sc = 0;
 
-		copy_addr += (UPDATE_BUF_SIZE - cl->ublen);
-		cl->ublen += (UPDATE_BUF_SIZE - cl->ublen);
-		do {
-			if (!rfbSendUpdateBuf(cl)) {
-				rfbLog("rfbSendUpdateBuf FAIL\n");
-				return FALSE;
+			if (ev->report_idx && ev->report_idx <= gadget.num_kbd)
+				r = &gadget.kbd[ev->report_idx - 1];
+
+			/* A key press must show up in the report it caused */
+			if (sc) {
+				for (n = 1; r && n < ikvm->report_size; ++n) {
+					if (r->data[n] == sc)
+						break;
+				}
+
+				if (!r || n == ikvm->report_size)
+					lost++;
 			}
+		} else if (ev->report_idx <= gadget.num_ptr) {
+			r = &gadget.ptr[ev->report_idx - 1];
+		}
 
-			copy_len = padding_len;
-			if (padding_len > (UPDATE_BUF_SIZE - cl->ublen)) {
-				padding_len -= (UPDATE_BUF_SIZE - cl->ublen);
-				copy_len = (UPDATE_BUF_SIZE - cl->ublen);
-			} else
-				padding_len = 0;
-
-			memcpy(&cl->updateBuf[cl->ublen], copy_addr, copy_len);
-			cl->ublen += copy_len;
-			copy_addr += copy_len;
-		} while (padding_len != 0);
-	} else {
-		memcpy(&cl->updateBuf[cl->ublen], copy_addr, ikvm->frame_size);
-		cl->ublen += ikvm->frame_size;
-		padding_len = 0;
-    }
+		if (r)
+			lat[num_lat++] = r->time_ns - ev->sent_ns;
+	}
 
-	if (cl->enableLastRectEncoding)
-		rfbSendLastRectMarker(cl);
+	printf("events: %u in %llu.%03llu s\n", num,
+	       elapsed_ns / 1000000000ULL, (elapsed_ns / 1000000ULL) % 1000);
+	printf("reports: keyboard %u pointer %u (%llu per second)\n",
+	       gadget.num_kbd, gadget.num_ptr,
+	       elapsed_ns ? ((gadget.num_kbd + gadget.num_ptr) *
+			     1000000000ULL) / elapsed_ns : 0);
+	printf("keystrokes lost %u merged %u, pointer events merged %u\n",
+	       lost, merged_kbd, merged_ptr);
+	print_percentiles("event to report latency", lat, num_lat);
 
-	rfbSendUpdateBuf(cl);
+	rc = (gadget.num_kbd == num_kbd && gadget.num_ptr == num_ptr &&
+	      !lost) ? 0 : -EIO;
 
-    return TRUE;
+done:
+	free(cl);
+	free(lat);
+	free(gadget.ptr);
+	free(gadget.kbd);
+	free(events);
+
+	return rc;
 }
 
-static void send_frame_to_clients(struct obmc_ikvm *ikvm)
+static void *soak_gadget_thread(void *ptr)
 {
-	if (ikvm->wait_next) {
-		ikvm->wait_next = false;
+	char buf[REPORT_SIZE + 1];
+	struct soak *soak = (struct soak *)ptr;
 
-		/* Wait for the rfb processing thread to finish it's work */
-		pthread_mutex_lock(&mutex);
-		pthread_cond_wait(&cond, &mutex);
-		ikvm->dont_wait = true;
+	while (read(soak->gadget_fd, buf, sizeof(buf)) > 0)
+		;
+
+	return NULL;
+}
+
+/* Stand in for the gadget unless real or mock HID devices were given */
+static int init_soak(struct obmc_ikvm *ikvm)
+{
+	int sv[2];
+	pthread_t thread;
+	struct soak *soak = &ikvm->soak;
+
+	if (!ikvm->playback.dir && (!ikvm->videodev_name ||
+	    strncmp(ikvm->videodev_name, PLAYBACK_PREFIX,
+		    strlen(PLAYBACK_PREFIX)))) {
+		printf("soak test needs -v %sdir\n", PLAYBACK_PREFIX);
+		return -EINVAL;
 	}
 
-	rfbClientIteratorPtr iterator = rfbGetClientIterator(ikvm->server);
-	rfbClientPtr cl;
+	soak->rss_kb = calloc(soak->cycles, sizeof(*soak->rss_kb));
+	soak->fds = calloc(soak->cycles, sizeof(*soak->fds));
+	soak->latency = calloc(soak->cycles, sizeof(*soak->latency));
+	soak->cpu = calloc(soak->cycles, sizeof(*soak->cpu));
+	if (!soak->rss_kb || !soak->fds || !soak->latency || !soak->cpu)
+		return -ENOMEM;
 
-	while (cl = rfbClientIteratorNext(iterator)) {
-#if 1
-		rfbHextile16(cl, ikvm);
+	if (ikvm->input_fd >= 0 || ikvm->keyboard_fd >= 0 ||
+	    ikvm->ptr_fd >= 0)
+		return 0;
 
-#else
-		rfbFramebufferUpdateMsg *fu =
-			(rfbFramebufferUpdateMsg *)cl->updateBuf;
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		printf("failed to create mock gadget: %d %s\n", errno,
+		       strerror(errno));
+		return -errno;
+	}
 
-		fu->type = rfbFramebufferUpdate;
+	ikvm->input_fd = sv[0];
+	ikvm->report_size = REPORT_SIZE - 1;
+	ikvm->server->kbdAddEvent = key_event;
+	ikvm->server->ptrAddEvent = ptr_event;
+	soak->gadget_fd = sv[1];
 
-		if (cl->enableLastRectEncoding)
-			fu->nRects = 0xFFFF;
-		else
-			fu->nRects = Swap16IfLE(1);
+	/* It goes once the daemon closes its end */
+	pthread_create(&thread, NULL, soak_gadget_thread, soak);
+	pthread_detach(thread);
+
+	return 0;
+}
+
+static long soak_rss_kb(void)
+{
+	long size;
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+			pages = 0;
+		fclose(f);
+	}
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int soak_fds(void)
+{
+	int num = 0;
+	struct dirent *e;
+	DIR *dir = opendir("/proc/self/fd");
+
+	if (!dir)
+		return -1;
 
-		cl->ublen = sz_rfbFramebufferUpdateMsg;
+	while ((e = readdir(dir)))
+		if (e->d_name[0] != '.')
+			num++;
 
-		rfbSendUpdateBuf(cl);
+	closedir(dir);
 
-		cl->tightEncoding = rfbEncodingTight;
+	/* Not counting the one reading the directory */
+	return num - 1;
+}
 
-		rfbSendTightHeader(cl, 0, 0, ikvm->resolution.width,
-				   ikvm->resolution.height);
+static unsigned long long process_cpu_ns(void)
+{
+	struct timespec now;
 
-		cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
 
-		rfbSendCompressedDataTight(cl, ikvm->frame, ikvm->frame_size);
+	return (now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
 
-		if (cl->enableLastRectEncoding)
-			rfbSendLastRectMarker(cl);
+static int soak_read(int fd, void *buf, size_t len)
+{
+	ssize_t rc;
 
-		rfbSendUpdateBuf(cl);
-#endif
+	while (len) {
+		rc = read(fd, buf, len);
+		if (rc <= 0)
+			return -EIO;
+
+		buf = (char *)buf + rc;
+		len -= rc;
 	}
 
-	rfbReleaseClientIterator(iterator);
+	return 0;
 }
 
-static int get_frame(struct obmc_ikvm *ikvm)
+static int soak_write(int fd, const void *buf, size_t len)
 {
-	int rc;
-	struct v4l2_format fmt;
+	return write(fd, buf, len) == (ssize_t)len ? 0 : -EIO;
+}
 
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
-	if (rc < 0) {
-		printf("failed to query format: %d %s\n", errno,
-		       strerror(errno));
-		return -EFAULT;
+/* Connect as a viewer and get through the RFB 3.8 handshake with no auth */
+static int soak_connect(const char *path)
+{
+	int fd;
+	uint8_t num;
+	uint32_t len;
+	char buf[256];
+	struct sockaddr_un addr;
+	struct timeval tv = { .tv_sec = SOAK_TIMEOUT_S };
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		goto err;
+
+	if (soak_read(fd, buf, 12) || soak_write(fd, "RFB 003.008\n", 12) ||
+	    soak_read(fd, &num, 1) || !num || soak_read(fd, buf, num) ||
+	    !memchr(buf, rfbSecTypeNone, num))
+		goto err;
+
+	buf[0] = rfbSecTypeNone;
+	if (soak_write(fd, buf, 1) || soak_read(fd, &len, 4) || len)
+		goto err;
+
+	/* Shared, then the ServerInit and its name */
+	buf[0] = 1;
+	if (soak_write(fd, buf, 1) || soak_read(fd, buf, 24))
+		goto err;
+
+	memcpy(&len, &buf[20], 4);
+	for (len = Swap32IfLE(len); len; len -= num) {
+		num = len < sizeof(buf) ? len : sizeof(buf);
+		if (soak_read(fd, buf, num))
+			goto err;
 	}
 
-	if (fmt.fmt.pix.width != ikvm->resolution.width ||
-	    fmt.fmt.pix.height != ikvm->resolution.height) {
-		char *old_frame = ikvm->frame;
-
-		rc = alloc_frame(ikvm, &fmt);
-		if (rc)
-			return rc;
+	return fd;
 
-		/* Wait for the rfb processing thread to finish it's work */
-		pthread_mutex_lock(&mutex);
-		pthread_cond_wait(&cond, &mutex);
-		ikvm->dont_wait = true;
+err:
+	close(fd);
+	return -EIO;
+}
 
-		rfbNewFramebuffer(ikvm->server, ikvm->frame,
-				  ikvm->resolution.width,
-				  ikvm->resolution.height,
-				  BITS_PER_SAMPLE, SAMPLES_PER_PIXEL,
-				  BYTES_PER_PIXEL);
-		rfbMarkRectAsModified(ikvm->server, 0, 0,
-				      ikvm->resolution.width,
-				      ikvm->resolution.height);
+/* Read whatever arrives until the connection has been quiet for a while */
+static void soak_drain(int fd)
+{
+	char buf[4096];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
 
-		free(old_frame);
+	while (poll(&pfd, 1, SOAK_DRAIN_MS) > 0 && read(fd, buf, sizeof(buf)) > 0)
+		;
+}
 
-		/* Get the image on the next iteration */
-		ikvm->wait_next = true;
-		return 0;
+/* One viewer session: an update, a burst of input, and hanging up */
+static int soak_cycle(struct obmc_ikvm *ikvm, unsigned long long *latency)
+{
+	int i;
+	int fd;
+	char c;
+	unsigned long long start_ns;
+	rfbFramebufferUpdateRequestMsg fur;
+	rfbKeyEventMsg ke;
+	rfbPointerEventMsg pe;
+
+	fd = soak_connect(ikvm->unix_path);
+	if (fd < 0)
+		return fd;
+
+	memset(&fur, 0, sizeof(fur));
+	fur.type = rfbFramebufferUpdateRequest;
+	fur.w = Swap16IfLE(ikvm->resolution.width);
+	fur.h = Swap16IfLE(ikvm->resolution.height);
+
+	start_ns = now_ns();
+	if (soak_write(fd, &fur, sz_rfbFramebufferUpdateRequestMsg) ||
+	    soak_read(fd, &c, 1)) {
+		close(fd);
+		return -EIO;
 	}
 
+	*latency = now_ns() - start_ns;
 
-	fmt.type = V4L2_BUF_TYPE_VIDEO_OVERLAY;
-	rc = ioctl(ikvm->videodev_fd, VIDIOC_G_FMT, &fmt);
-	if (rc < 0) {
-		printf("failed to query format: %d %s\n", errno,
-			strerror(errno));
-		return -EFAULT;
-	}
+	memset(&ke, 0, sizeof(ke));
+	memset(&pe, 0, sizeof(pe));
+	ke.type = rfbKeyEvent;
+	ke.key = Swap32IfLE(XK_a);
+	pe.type = rfbPointerEvent;
 
-	ikvm->nRects = fmt.fmt.win.clipcount;
+	for (i = 0; i < SOAK_INPUT_EVENTS; ++i) {
+		ke.down = !(i & 1);
+		pe.x = Swap16IfLE(i * 8);
+		pe.y = Swap16IfLE(i * 4);
 
-	rc = read(ikvm->videodev_fd, ikvm->frame, ikvm->frame_buf_size);
-	if (rc < 0) {
-		printf("failed to read frame: %d %s\n", errno,
-		       strerror(errno));
-		return -EFAULT;
+		if (soak_write(fd, &ke, sz_rfbKeyEventMsg) ||
+		    soak_write(fd, &pe, sz_rfbPointerEventMsg))
+			break;
 	}
 
-	if (rc != ikvm->frame_size)
-		DBG("new frame size: %d\n", rc);
+	fur.incremental = 1;
+	if (!soak_write(fd, &fur, sz_rfbFramebufferUpdateRequestMsg))
+		soak_drain(fd);
 
-	ikvm->frame_size = rc;
-	send_frame_to_clients(ikvm);
+	close(fd);
 
 	return 0;
 }
 
-static int timespec_subtract(struct timespec *result, struct timespec *x,
-			     struct timespec *y)
+static unsigned long long soak_median(unsigned long long *v, unsigned int num)
 {
-	/* Perform the carry for the later subtraction by updating y. */
-	if (x->tv_nsec < y->tv_nsec) {
-		long long int nsec =
-			((y->tv_nsec - x->tv_nsec) / 1000000000ULL) + 1;
+	qsort(v, num, sizeof(*v), cmp_ull);
 
-		y->tv_nsec -= 1000000000ULL * nsec;
-		y->tv_sec += nsec;
+	return v[num / 2];
+}
+
+/*
+ * Compare the last tenth of the run against the tenth after warming up:
+ * any descriptor, memory beyond some slack, or latency or CPU per cycle
+ * that has more than doubled is a regression.
+ */
+static int soak_verdict(struct soak *soak)
+{
+	int rc = 0;
+	unsigned int w = soak->cycles / 10;
+	unsigned int last = soak->cycles - 1;
+	unsigned long long lat_first = soak_median(&soak->latency[w], w);
+	unsigned long long lat_last = soak_median(&soak->latency[last + 1 - w],
+						  w);
+	unsigned long long cpu_first = soak_median(&soak->cpu[w], w);
+	unsigned long long cpu_last = soak_median(&soak->cpu[last + 1 - w], w);
+
+	printf("soak: rss %ld -> %ld kB, fds %d -> %d, update latency %llu -> "
+	       "%llu us, cpu %llu -> %llu us per cycle\n", soak->rss_kb[w],
+	       soak->rss_kb[last], soak->fds[w], soak->fds[last],
+	       lat_first / 1000, lat_last / 1000, cpu_first / 1000,
+	       cpu_last / 1000);
+	print_percentiles("soak update latency", soak->latency, soak->cycles);
+
+	if (soak->rss_kb[last] > soak->rss_kb[w] + SOAK_RSS_SLACK_KB) {
+		printf("soak failed: memory grew\n");
+		rc = -EIO;
 	}
 
-	if (x->tv_nsec - y->tv_nsec > 1000000000ULL) {
-		long long int nsec = (x->tv_nsec - y->tv_nsec) / 1000000000ULL;
+	if (soak->fds[last] > soak->fds[w]) {
+		printf("soak failed: descriptors leaked\n");
+		rc = -EIO;
+	}
 
-		y->tv_nsec += 1000000000ULL * nsec;
-		y->tv_sec -= nsec;
+	if (lat_last > (lat_first * 2) + SOAK_DRIFT_SLACK_NS) {
+		printf("soak failed: update latency drifted\n");
+		rc = -EIO;
 	}
 
-	/*
-	 * Compute the time remaining to wait.
-	 * tv_nsec is certainly positive.
-	 */
-	result->tv_sec = x->tv_sec - y->tv_sec;
-	result->tv_nsec = x->tv_nsec - y->tv_nsec;
+	if (cpu_last > (cpu_first * 2) + SOAK_DRIFT_SLACK_NS) {
+		printf("soak failed: cpu per cycle drifted\n");
+		rc = -EIO;
+	}
 
-	/* Return 1 if result is negative. */
-	return x->tv_sec < y->tv_sec;
+	return rc;
 }
 
-static void dump_frame(struct obmc_ikvm *ikvm)
+static void *soak_thread(void *ptr)
 {
-	int fd;
 	int rc;
-	char path[256];
+	unsigned int i;
+	struct obmc_ikvm *ikvm = (struct obmc_ikvm *)ptr;
+	struct soak *soak = &ikvm->soak;
+	unsigned long long cpu_ns = process_cpu_ns();
 
-	snprintf(path, 256, "%s/frame%03d.bin", DUMP_FRAME_DIR,
-		 ikvm->dump_frame_idx++);
+	for (i = 0; i < soak->cycles && ok; ++i) {
+		unsigned long long now;
 
-	fd = open(path, O_WRONLY | O_CREAT, 0666);
-	if (fd < 0) {
-		printf("failed to open %s: %d %s\n", path, errno,
-		       strerror(errno));
-		return;
-	}
+		if (i && !(i % SOAK_MODE_CYCLES))
+			__atomic_store_n(&ikvm->playback.mode_change, true,
+					 __ATOMIC_RELEASE);
 
-	rc = write(fd, ikvm->frame, ikvm->frame_size);
-	if (rc < ikvm->frame_size)
-		printf("failed to write frame: %d %s\n", errno,
-		       strerror(errno));
+		rc = soak_cycle(ikvm, &soak->latency[i]);
+		if (rc) {
+			printf("soak failed: cycle %u got no update\n", i);
+			soak->rc = rc;
+			break;
+		}
 
-	close(fd);
-}
+		now = process_cpu_ns();
+		soak->cpu[i] = now - cpu_ns;
+		cpu_ns = now;
+		soak->rss_kb[i] = soak_rss_kb();
+		soak->fds[i] = soak_fds();
 
-void *threaded_process_rfb(void *ptr)
-{
-	struct timespec diff;
-	struct timespec end;
-	struct timespec start;
-	struct obmc_ikvm *ikvm = (struct obmc_ikvm *)ptr;
+		if (!((i + 1) % SOAK_PRINT_CYCLES))
+			printf("soak %u/%u: rss %ld kB fds %d latency %llu us\n",
+			       i + 1, soak->cycles, soak->rss_kb[i],
+			       soak->fds[i], soak->latency[i] / 1000);
+	}
 
-	while (ok) {
-		rfbProcessEvents(ikvm->server, ikvm->process_events_time_us);
-#ifdef _PROFILE_
-		clock_gettime(CLOCK_MONOTONIC, &start);
-#endif /* _PROFILE_ */
-		if (ikvm->server->clientHead != NULL && ok) {
-			keyboard_send_report(ikvm);
-			ptr_send_report(ikvm);
-		}
-#ifdef _PROFILE_
-		clock_gettime(CLOCK_MONOTONIC, &end);
-		timespec_subtract(&diff, &end, &start);
-		_prof(&diff, &_input);
-		DBG("input: %lld.%.9ld\n", (long long)diff.tv_sec,
-		    diff.tv_nsec);
-#endif /* _PROFILE_ */
+	if (!soak->rc && i == soak->cycles)
+		soak->rc = soak_verdict(soak);
+	else if (!soak->rc)
+		soak->rc = -EINTR;
 
-		pthread_mutex_lock(&mutex);
-		pthread_cond_broadcast(&cond);
-		pthread_mutex_unlock(&mutex);
-	}
+	ok = false;
 
 	return NULL;
 }
@@ -1058,46 +6625,202 @@ void usage()
 {
 	fprintf(stderr, "OpenBMC IKVM daemon\n");
 	fprintf(stderr, "Usage: obmc-ikvm [options]\n");
+	fprintf(stderr, "-b events              replay recorded input events "
+		"against a mock\n");
+	fprintf(stderr, "                       gadget and report input "
+		"latency\n");
+	fprintf(stderr, "-c clients             let at most this many clients "
+		"control the host\n");
+	fprintf(stderr, "-C cert                PEM certificate chain; with "
+		"-K, only accept\n");
+	fprintf(stderr, "                       VeNCrypt sessions encrypted "
+		"by kernel TLS\n");
+	fprintf(stderr, "-e path                hand local consumers a "
+		"read-only frame ring\n");
+	fprintf(stderr, "                       over a SOCK_SEQPACKET socket "
+		"at path\n");
+	fprintf(stderr, "-E path                publish screen changed, stable, "
+		"resolution and\n");
+	fprintf(stderr, "                       signal events over a "
+		"SOCK_SEQPACKET socket at path\n");
 	fprintf(stderr, "-f frame rate          use this frame rate\n");
+	fprintf(stderr, "-g ms                  once the picture holds still "
+		"this long, send one\n");
+	fprintf(stderr, "                       refresh at the best jpeg "
+		"quality and then idle\n");
+	fprintf(stderr, "-G quality             jpeg quality while the picture "
+		"moves, with -g\n");
 	fprintf(stderr, "-i device              HID gadget combined device\n");
 	fprintf(stderr, "-k keyboard            HID gadget keyboard device\n");
+	fprintf(stderr, "-K key                 PEM private key for -C\n");
+	fprintf(stderr, "-l ms                  keep clients that support "
+		"fences at most this\n");
+	fprintf(stderr, "                       far behind the capture "
+		"(default %d)\n", DEFAULT_MAX_LATENCY_MS);
+	fprintf(stderr, "-L probes[:keysym]     time this many injected "
+		"pointer moves, or key\n");
+	fprintf(stderr, "                       presses, to the frame showing "
+		"them; then exit\n");
+	fprintf(stderr, "-m                     lock memory to avoid paging\n");
+	fprintf(stderr, "-M path                type key macros sent to a "
+		"SOCK_SEQPACKET socket at\n");
+	fprintf(stderr, "                       path: [stable] keys KEY... "
+		"[every ms] [for ms],\n");
+	fprintf(stderr, "                       or stop; KEY like F12, "
+		"Ctrl+Alt+Delete or 0xff0d\n");
+	fprintf(stderr, "-O cycles              soak test: connect, type and "
+		"hang up this many\n");
+	fprintf(stderr, "                       times with mode changes, "
+		"against -v %sdir;\n", PLAYBACK_PREFIX);
+	fprintf(stderr, "                       fail if memory, descriptors, "
+		"latency or cpu grow\n");
 	fprintf(stderr, "-p mouse               HID gadget mouse device\n");
-	fprintf(stderr, "-v device              V4L2 device\n");
+	fprintf(stderr, "-P us                  send pointer reports no more "
+		"often than this, the\n");
+	fprintf(stderr, "                       gadget's endpoint interval "
+		"(default %d)\n", PTR_INTERVAL_US);
+	fprintf(stderr, "-q bytes               hold updates back from clients "
+		"with more than this\n");
+	fprintf(stderr, "                       in their socket; drop them "
+		"after %d ms\n", CLIENT_STALL_MS);
+	fprintf(stderr, "-r host[:port]         stream to an aggregator "
+		"listening as a viewer\n");
+	fprintf(stderr, "                       (default port %s); add "
+		"-rfbport 0 to take no\n", RELAY_DEFAULT_PORT);
+	fprintf(stderr, "                       direct viewers\n");
+	fprintf(stderr, "-R events              record input events to this "
+		"file\n");
+	fprintf(stderr, "-s role=policy[:prio][@cpus]\n");
+	fprintf(stderr, "                       scheduling for capture or rfb "
+		"thread;\n");
+	fprintf(stderr, "                       policy fifo, rr or other, prio "
+		"is nice for other\n");
+	fprintf(stderr, "-S scale               shrink thumbnails by this "
+		"much (default %d)\n", THUMB_SCALE);
+	fprintf(stderr, "-T port                serve view-only thumbnails, "
+		"refreshed every\n");
+	fprintf(stderr, "                       %d ms, on this port\n",
+		THUMB_INTERVAL_MS);
+	fprintf(stderr, "-t events              trace the last events frame "
+		"stages; SIGUSR2 dumps\n");
+	fprintf(stderr, "                       them to %s\n", TRACE_FILE);
+	fprintf(stderr, "-u path                also take viewers on a unix "
+		"socket at path; add\n");
+	fprintf(stderr, "                       -rfbport 0 to take them only "
+		"there\n");
+	fprintf(stderr, "-v device              V4L2 device, or %sdir to play "
+		"back frames saved\n", PLAYBACK_PREFIX);
+	fprintf(stderr, "                       by -d, one further for each "
+		"input report\n");
+	fprintf(stderr, "-w spectators          past -c, let this many more "
+		"connect view-only\n");
+	fprintf(stderr, "-W ms                  call the screen stable, for -E, "
+		"after this long\n");
+	fprintf(stderr, "                       without change (default %d)\n",
+		EVENTS_STABLE_MS);
+	fprintf(stderr, "-z                     pointer reports end in a wheel "
+		"byte; the gadget's\n");
+	fprintf(stderr, "                       report descriptor must have "
+		"one\n");
+	fprintf(stderr, "SIGUSR1 prints scheduling, pacing and per-client "
+		"stats\n");
+	fprintf(stderr, "HID devices of the form unix:path connect to a "
+		"SOCK_SEQPACKET socket\n");
 	rfbUsage();
 }
 
 int main(int argc, char **argv)
 {
+	unsigned int i;
 	int len;
 	int option;
 	int rc;
-	const char *opts = "dhi:k:p:v:";
+	const char *opts = "b:c:C:de:E:f:g:G:hi:k:K:l:L:mM:O:p:P:q:r:R:s:S:t:T:u:v:w:W:z";
 	struct option lopts[] = {
+		{ "bench_input", 1, 0, 'b' },
+		{ "max_clients", 1, 0, 'c' },
+		{ "tls_cert", 1, 0, 'C' },
 		{ "dump_frames", 0, 0, 'd' },
+		{ "export", 1, 0, 'e' },
+		{ "events", 1, 0, 'E' },
 		{ "frame_rate", 1, 0, 'f' },
+		{ "refine", 1, 0, 'g' },
+		{ "motion_quality", 1, 0, 'G' },
 		{ "help", 0, 0, 'h' },
 		{ "input", 1, 0, 'i' },
 		{ "keyboard", 1, 0, 'k' },
+		{ "tls_key", 1, 0, 'K' },
+		{ "max_latency", 1, 0, 'l' },
+		{ "latency_test", 1, 0, 'L' },
+		{ "mlock", 0, 0, 'm' },
+		{ "macros", 1, 0, 'M' },
+		{ "soak", 1, 0, 'O' },
 		{ "pointer", 1, 0, 'p' },
+		{ "ptr_interval", 1, 0, 'P' },
+		{ "max_queued", 1, 0, 'q' },
+		{ "relay", 1, 0, 'r' },
+		{ "record_input", 1, 0, 'R' },
+		{ "sched", 1, 0, 's' },
+		{ "thumbnail_scale", 1, 0, 'S' },
+		{ "trace", 1, 0, 't' },
+		{ "thumbnail_port", 1, 0, 'T' },
+		{ "unix_socket", 1, 0, 'u' },
 		{ "videodev", 1, 0, 'v' },
+		{ "max_spectators", 1, 0, 'w' },
+		{ "stable_ms", 1, 0, 'W' },
+		{ "wheel", 0, 0, 'z' },
 		{ 0, 0, 0, 0 }
 	};
+	char *bench_name = NULL;
+	char *events_path = NULL;
+	char *export_path = NULL;
+	char *macro_path = NULL;
+	char *unix_path = NULL;
+	char *keysym;
 	struct obmc_ikvm ikvm;
 	struct timespec diff;
 	struct timespec end;
 	struct timespec start;
 	pthread_t rfb;
+	pthread_t soak;
+	pthread_t macro;
 
 	memset(&ikvm, 0, sizeof(struct obmc_ikvm));
 	ikvm.frame_rate = 30;
+	ikvm.max_latency_ns = DEFAULT_MAX_LATENCY_MS * 1000000ULL;
+	ikvm.motion_quality = -1;
 	ikvm.videodev_fd = -1;
+	ikvm.export.fd = -1;
+	ikvm.export.ro_fd = -1;
+	ikvm.export.listen_fd = -1;
+	ikvm.events.listen_fd = -1;
+	ikvm.events.stable_ms = EVENTS_STABLE_MS;
+	ikvm.macro.listen_fd = -1;
+	ikvm.relay.fd = -1;
+	ikvm.unix_fd = -1;
+	ikvm.thumb.scale = THUMB_SCALE;
+	ikvm.relay.retry_ms = RELAY_RETRY_MIN_MS;
+	ikvm.video_retry_ms = VIDEO_RETRY_MIN_MS;
 	ikvm.input_fd = -1;
 	ikvm.keyboard_fd = -1;
 	ikvm.ptr_fd = -1;
 	ikvm.report_size = REPORT_SIZE;
+	ikvm.ptr_size = PTR_SIZE;
+	ikvm.ptr_interval_ns = PTR_INTERVAL_US * 1000ULL;
 
 	while ((option = getopt_long(argc, argv, opts, lopts, NULL)) != -1) {
 		switch (option) {
+		case 'b':
+			bench_name = optarg;
+			break;
+		case 'c':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.max_clients = len;
+			break;
+		case 'C':
+			ikvm.tls_cert = optarg;
+			break;
 		case 'd':
 			ikvm.dump_frames = true;
 			rc = mkdir(DUMP_FRAME_DIR, 0777);
@@ -1107,10 +6830,25 @@ int main(int argc, char **argv)
 				ikvm.dump_frames = false;
 			}
 			break;
+		case 'e':
+			export_path = optarg;
+			break;
+		case 'E':
+			events_path = optarg;
+			break;
 		case 'f':
 			ikvm.frame_rate = (int)strtol(optarg, NULL, 0);
-			if (ikvm.frame_rate < 0 || ikvm.frame_rate >= 60)
+			if (ikvm.frame_rate <= 0 || ikvm.frame_rate >= 60)
 				ikvm.frame_rate = 30;
+			break;
+		case 'g':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.refine.static_ms = len;
+			break;
+		case 'G':
+			ikvm.motion_quality = (int)strtol(optarg, NULL, 0);
+			break;
 		case 'i':
 			if (ikvm.keyboard_fd >= 0 || ikvm.ptr_fd >= 0)
 				break;
@@ -1131,6 +6869,34 @@ int main(int argc, char **argv)
 			else
 				strcpy(ikvm.keyboard_name, optarg);
 			break;
+		case 'K':
+			ikvm.tls_key = optarg;
+			break;
+		case 'l':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.max_latency_ns = len * 1000000ULL;
+			break;
+		case 'L':
+			len = (int)strtol(optarg, &keysym, 0);
+			if (len > 0)
+				ikvm.latency.probes = len;
+			if (*keysym == ':')
+				ikvm.latency.keysym = strtoul(keysym + 1,
+							      NULL, 0);
+			break;
+		case 'm':
+			ikvm.lock_memory = true;
+			break;
+		case 'M':
+			macro_path = optarg;
+			break;
+		case 'O':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.soak.cycles = len < SOAK_MIN_CYCLES ?
+					SOAK_MIN_CYCLES : len;
+			break;
 		case 'p':
 			if (ikvm.input_fd >= 0)
 				break;
@@ -1141,6 +6907,50 @@ int main(int argc, char **argv)
 			else
 				strcpy(ikvm.ptr_name, optarg);
 			break;
+		case 'P':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len >= 0)
+				ikvm.ptr_interval_ns = len * 1000ULL;
+			break;
+		case 'q':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.max_queued = len;
+			break;
+		case 'r':
+			if (parse_relay(&ikvm.relay, optarg)) {
+				printf("invalid relay %s\n", optarg);
+				rc = -EINVAL;
+				goto done;
+			}
+			break;
+		case 'R':
+			ikvm.record_file = fopen(optarg, "w");
+			if (!ikvm.record_file)
+				printf("failed to open %s: %d %s\n", optarg,
+				       errno, strerror(errno));
+			break;
+		case 's':
+			if (parse_sched(&ikvm, optarg))
+				printf("invalid scheduling option %s; ignoring\n",
+				       optarg);
+			break;
+		case 'S':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.thumb.scale = len;
+			break;
+		case 'T':
+			ikvm.thumb.port = (int)strtol(optarg, NULL, 0);
+			break;
+		case 't':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0 && !ikvm.trace.events)
+				init_trace(&ikvm.trace, len);
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
 		case 'v':
 			ikvm.videodev_name = malloc(strlen(optarg) + 1);
 			if (!ikvm.videodev_name) {
@@ -1150,6 +6960,19 @@ int main(int argc, char **argv)
 
 			strcpy(ikvm.videodev_name, optarg);
 			break;
+		case 'w':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.max_spectators = len;
+			break;
+		case 'W':
+			len = (int)strtol(optarg, NULL, 0);
+			if (len > 0)
+				ikvm.events.stable_ms = len;
+			break;
+		case 'z':
+			ikvm.ptr_size = PTR_SIZE + 1;
+			break;
 		case 'h':
 			usage();
 			goto done;
@@ -1161,7 +6984,17 @@ int main(int argc, char **argv)
 	ikvm.process_events_time_us = ikvm.frame_time_us -
 		PROCESS_EVENTS_DELTA;
 
-	rc = init_videodev(&ikvm);
+	if (bench_name) {
+		rc = bench_input(&ikvm, bench_name, &argc, argv);
+		goto done;
+	}
+
+	/*
+	 * Serve a blank placeholder until the video device is up; the capture
+	 * loop opens it in the background and switches the framebuffer over to
+	 * the real resolution once it delivers frames.
+	 */
+	rc = alloc_fb(&ikvm, DEFAULT_WIDTH, DEFAULT_HEIGHT);
 	if (rc)
 		goto done;
 
@@ -1169,6 +7002,71 @@ int main(int argc, char **argv)
 	if (rc)
 		goto done;
 
+	if (ikvm.thumb.port) {
+		rc = init_thumb(&ikvm);
+		if (rc)
+			goto done;
+	}
+
+	/* The soak test's viewers come in over the unix socket */
+	if (ikvm.soak.cycles && !unix_path)
+		unix_path = SOAK_SOCKET;
+
+	if (unix_path) {
+		rc = init_unix(&ikvm, unix_path);
+		if (rc) {
+			printf("failed to listen on %s: %d %s\n", unix_path,
+			       -rc, strerror(-rc));
+			goto done;
+		}
+	}
+
+	if (export_path) {
+		rc = init_export(&ikvm.export, export_path);
+		if (rc)
+			printf("failed to export frames at %s: %d %s\n",
+			       export_path, -rc, strerror(-rc));
+	}
+
+	if (events_path) {
+		rc = init_events(&ikvm, events_path);
+		if (rc)
+			printf("failed to publish events at %s: %d %s\n",
+			       events_path, -rc, strerror(-rc));
+	}
+
+	if (ikvm.tls_cert || ikvm.tls_key) {
+		if (!ikvm.tls_cert || !ikvm.tls_key) {
+			printf("tls needs both a certificate and a key\n");
+			rc = -EINVAL;
+			goto done;
+		}
+
+		/* libvncserver lets reverse connections pick no security */
+		if (ikvm.relay.host) {
+			printf("relay connections can't be encrypted; drop -r "
+			       "or -C and -K\n");
+			rc = -EINVAL;
+			goto done;
+		}
+
+		/* Nor is the thumbnail, which shows the same screen */
+		if (ikvm.thumb.port) {
+			printf("the thumbnail can't be encrypted; drop -T or -C "
+			       "and -K\n");
+			rc = -EINVAL;
+			goto done;
+		}
+
+		rc = init_tls(&ikvm);
+		if (rc)
+			goto done;
+	}
+
+	if (ikvm.record_file)
+		fprintf(ikvm.record_file, "r %zu %zu\n", ikvm.resolution.width,
+			ikvm.resolution.height);
+
 	if (ikvm.input_name) {
 		init_input(&ikvm);
 	} else {
@@ -1179,25 +7077,119 @@ int main(int argc, char **argv)
 			init_ptr(&ikvm);
 	}
 
+	if (ikvm.latency.probes) {
+		rc = init_latency(&ikvm);
+		if (rc)
+			goto done;
+	}
+
+	if (ikvm.soak.cycles) {
+		rc = init_soak(&ikvm);
+		if (rc)
+			goto done;
+	}
+
+	/* Only offer scancodes when there's a keyboard to type them on */
+	if (ikvm.input_fd >= 0 || ikvm.keyboard_fd >= 0)
+		rfbRegisterProtocolExtension(&qemu_key_extension);
+
+	if (macro_path) {
+		rc = init_macro(&ikvm, macro_path);
+		if (rc) {
+			printf("failed to take macros at %s: %d %s\n",
+			       macro_path, -rc, strerror(-rc));
+			goto done;
+		}
+	}
+
 	signal(SIGINT, int_handler);
+	signal(SIGUSR1, usr1_handler);
+	signal(SIGUSR2, usr2_handler);
+
+	/*
+	 * Lock what is mapped now (code, libraries and the frame buffers);
+	 * later frame buffers are locked as they're allocated. Not using
+	 * MCL_FUTURE avoids pinning the whole stack of the rfb thread.
+	 */
+	if (ikvm.lock_memory && mlockall(MCL_CURRENT))
+		printf("failed to lock memory: %d %s\n", errno,
+		       strerror(errno));
 
 	pthread_create(&rfb, NULL, threaded_process_rfb, &ikvm);
 
+	if (ikvm.soak.cycles)
+		pthread_create(&soak, NULL, soak_thread, &ikvm);
+
+	if (ikvm.macro.listen_fd >= 0)
+		pthread_create(&macro, NULL, macro_thread, &ikvm);
+
+	apply_sched(&ikvm, SCHED_ROLE_CAPTURE);
+	init_pacing(&ikvm.pacing, ikvm.frame_rate);
+
 	while (ok) {
-		if (ikvm.delay_count)
+		jitter_sample(&ikvm.jitter[SCHED_ROLE_CAPTURE]);
+
+		if (dump_stats) {
+			dump_stats = false;
+			print_jitter(&ikvm);
+			print_pacing(&ikvm);
+			print_clients(&ikvm);
+		}
+
+		if (dump_trace) {
+			dump_trace = false;
+			write_trace(&ikvm);
+		}
+
+		if (ikvm.export.listen_fd >= 0)
+			poll_export(&ikvm);
+
+		if (ikvm.events.listen_fd >= 0)
+			poll_events(&ikvm);
+
+		if (ikvm.reset_video) {
+			ikvm.reset_video = false;
+			close_videodev(&ikvm);
+			ikvm.video_retry_ns = 0;
+		}
+
+		if (ikvm.video_state != VIDEO_STREAMING) {
+			send_fb_to_clients(&ikvm);
+			video_recover(&ikvm);
+		}
+		else if (ikvm.delay_count)
 			ikvm.delay_count--;
-		else if (ikvm.server->clientHead != NULL || ikvm.dump_frames) {
+		else if (clients_waiting(&ikvm) || ikvm.dump_frames ||
+			 ikvm.latency.probes ||
+			 ikvm.export.num_consumers ||
+			 ikvm.events.num_subscribers || macro_waiting(&ikvm) ||
+			 thumb_due(&ikvm)) {
 #ifdef _PROFILE_
 			clock_gettime(CLOCK_MONOTONIC, &start);
 #endif /* _PROFILE_ */
 			rc = get_frame(&ikvm);
-			if (rc) {
-				ok = false;
-				break;
+			if (rc < 0) {
+				video_failed(&ikvm, rc);
+			} else if (rc == FRAME_NONE) {
+				/* What's in the buffer is from before; hold it */
+				video_streaming(&ikvm);
+				rc = 0;
+			} else {
+				video_streaming(&ikvm);
+
+				if (ikvm.dump_frames)
+					dump_frame(&ikvm);
+
+				if (ikvm.export.num_consumers)
+					export_frame(&ikvm);
+
+				if (ikvm.events.num_subscribers ||
+				    macro_waiting(&ikvm))
+					events_frame(&ikvm);
+
+				if (ikvm.thumb.server)
+					update_thumb(&ikvm);
 			}
-
-			if (ikvm.dump_frames)
-				dump_frame(&ikvm);
 #ifdef _PROFILE_
 			clock_gettime(CLOCK_MONOTONIC, &end);
 			timespec_subtract(&diff, &end, &start);
@@ -1210,14 +7202,12 @@ int main(int argc, char **argv)
 #ifdef _PROFILE_
 		clock_gettime(CLOCK_MONOTONIC, &start);
 #endif /* _PROFILE_ */
-		if (!ikvm.dont_wait) {
-			pthread_mutex_lock(&mutex);
-			pthread_cond_wait(&cond, &mutex);
-			pthread_mutex_unlock(&mutex);
-		} else {
+		if (ikvm.dont_wait) {
 			pthread_mutex_unlock(&mutex);
 			ikvm.dont_wait = false;
 		}
+
+		wait_pacing(&ikvm.pacing);
 #ifdef _PROFILE_
 		clock_gettime(CLOCK_MONOTONIC, &end);
 		timespec_subtract(&diff, &end, &start);
@@ -1229,6 +7219,17 @@ int main(int argc, char **argv)
 
 	pthread_join(rfb, NULL);
 
+	if (ikvm.macro.listen_fd >= 0)
+		pthread_join(macro, NULL);
+
+	if (ikvm.soak.cycles) {
+		pthread_join(soak, NULL);
+		rc = ikvm.soak.rc;
+	}
+
+	print_jitter(&ikvm);
+	print_pacing(&ikvm);
+
 #ifdef _PROFILE_
 	printf("avg frame time (us): %lld\n", _avg(&_frame));
 	printf("avg input time (us): %lld\n", _avg(&_input));
@@ -1239,9 +7240,30 @@ done:
 	if (ikvm.server)
 		rfbScreenCleanup(ikvm.server);
 
+	if (ikvm.thumb.server)
+		rfbScreenCleanup(ikvm.thumb.server);
+
+	free(ikvm.thumb.fb);
+
 	if (ikvm.frame)
 		free(ikvm.frame);
 
+	if (ikvm.fb)
+		munmap(ikvm.fb, ikvm.fb_size);
+
+#ifdef _TLS_
+	if (ikvm.tls_ctx)
+		SSL_CTX_free(ikvm.tls_ctx);
+#endif /* _TLS_ */
+
+	for (i = 0; i < ikvm.rect_table_size; ++i)
+		free(ikvm.rect_table[i].data);
+
+	free(ikvm.rects);
+	free(ikvm.rect_table);
+	free(ikvm.tile_seq);
+	free(ikvm.sorted);
+
 	if (ikvm.videodev_fd >= 0)
 		close(ikvm.videodev_fd);
 
@@ -1266,5 +7288,41 @@ done:
 	if (ikvm.videodev_name)
 		free(ikvm.videodev_name);
 
+	if (ikvm.trace.events)
+		free(ikvm.trace.events);
+
+	if (ikvm.record_file)
+		fclose(ikvm.record_file);
+
+	close_export(&ikvm.export);
+	close_events(&ikvm.events);
+	close_macro(&ikvm.macro);
+
+	if (ikvm.relay.fd >= 0)
+		close(ikvm.relay.fd);
+
+	/* A lookup still going on has the name; leave it to the exit */
+	switch (__atomic_load_n(&ikvm.relay.dns, __ATOMIC_ACQUIRE)) {
+	case RELAY_DNS_DONE:
+		if (ikvm.relay.res)
+			freeaddrinfo(ikvm.relay.res);
+		/* fallthrough */
+	case RELAY_DNS_IDLE:
+		free(ikvm.relay.spec);
+		break;
+	}
+
+	if (ikvm.unix_fd >= 0) {
+		close(ikvm.unix_fd);
+		unlink(ikvm.unix_path);
+	}
+
+	free(ikvm.latency.total);
+	free(ikvm.latency.cl);
+	free(ikvm.soak.rss_kb);
+	free(ikvm.soak.fds);
+	free(ikvm.soak.latency);
+	free(ikvm.soak.cpu);
+
 	return rc;
 }